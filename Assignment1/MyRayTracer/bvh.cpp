@@ -5,7 +5,9 @@ using namespace std;
 
 BVH::BVHNode::BVHNode(void) {}
 
-void BVH::BVHNode::setAABB(AABB& bbox_) { this->bbox = bbox_; }
+void BVH::BVHNode::setAABB(AABB& bbox_) { this->bbox = bbox_; this->bbox1 = bbox_; }
+
+void BVH::BVHNode::setAABB(AABB& bbox0_, AABB& bbox1_) { this->bbox = bbox0_; this->bbox1 = bbox1_; }
 
 void BVH::BVHNode::makeLeaf(unsigned int index_, unsigned int n_objs_) {
 	this->leaf = true;
@@ -24,25 +26,63 @@ BVH::BVH(void) {}
 
 int BVH::getNumObjects() { return objects.size(); }
 
+//Bounds of primitives [first, last) at shutter open and close
+static void motion_bounds(vector<BuildPrimitive>& prims, int first, int last, AABB& bbox0, AABB& bbox1) {
+	bbox0 = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	bbox1 = bbox0;
+	for (int i = first; i < last; i++) {
+		bbox0.extend(AABB(prims[i].min0, prims[i].max0));
+		bbox1.extend(AABB(prims[i].min1, prims[i].max1));
+	}
+}
+
 
 void BVH::Build(vector<Object*>& objs) {
 
 
 	BVHNode* root = new BVHNode();
 
-	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
-	AABB world_bbox = AABB(min, max);
+	//bounds and centroids are computed once here; the recursion only partitions this packed array
+	AABB world_bbox = snapshot_primitives(objs, primitives);
+
+	is_sphere.assign(objs.size(), false);
+	for (unsigned int i = 0; sphere_packets && i < objs.size(); i++)
+		is_sphere[i] = dynamic_cast<Sphere*>(objs[i]) != NULL;
+
+	has_motion = false;
+	for (Object* obj : objs)
+		has_motion = has_motion || obj->IsMoving();
 
-	for (Object* obj : objs) {
-		AABB bbox = obj->GetBoundingBox();
-		world_bbox.extend(bbox);
-		objects.push_back(obj);
-	}
 	world_bbox.min.x -= EPSILON; world_bbox.min.y -= EPSILON; world_bbox.min.z -= EPSILON;
 	world_bbox.max.x += EPSILON; world_bbox.max.y += EPSILON; world_bbox.max.z += EPSILON;
-	root->setAABB(world_bbox);
+	if (has_motion) {
+		AABB world_bbox0, world_bbox1;
+		motion_bounds(primitives, 0, primitives.size(), world_bbox0, world_bbox1);
+		world_bbox0.min.x -= EPSILON; world_bbox0.min.y -= EPSILON; world_bbox0.min.z -= EPSILON;
+		world_bbox0.max.x += EPSILON; world_bbox0.max.y += EPSILON; world_bbox0.max.z += EPSILON;
+		world_bbox1.min.x -= EPSILON; world_bbox1.min.y -= EPSILON; world_bbox1.min.z -= EPSILON;
+		world_bbox1.max.x += EPSILON; world_bbox1.max.y += EPSILON; world_bbox1.max.z += EPSILON;
+		root->setAABB(world_bbox0, world_bbox1);
+	}
+	else
+		root->setAABB(world_bbox);
 	nodes.push_back(root);
-	build_recursive(0, objects.size(), root); // -> root node takes all the 
+	build_recursive(0, primitives.size(), root); // -> root node takes all the 
+
+	//leaves index the objects vector, so lay the objects out in the final primitive order
+	objects.reserve(objects.size() + primitives.size());
+	for (BuildPrimitive& prim : primitives) {
+		objects.push_back(objs[prim.index]);
+	}
+	for (BVHNode* node : nodes) {
+		if (node->isLeaf() && node->getPacket() >= 0)
+			pack_leaf(node);
+	}
+	primitives.clear();
+	primitives.shrink_to_fit();
+	is_sphere.clear();
+	build_cost = SAHCost();
+
 	//printf("num_of_nodes:%d\n", nodes.size());
 	int num_leafs = 0;
 	for (int i = 0; i < nodes.size(); i++) {
@@ -53,13 +93,24 @@ void BVH::Build(vector<Object*>& objs) {
 	//printf("num_leafs:%d\n", num_leafs);
 }
 
-void BVH::build_recursive(int left_index, int right_index, BVHNode* node) {
+void BVH::build_recursive(int left_index, int right_index, BVHNode* node, int depth) {
 
 	int num_objs = (right_index - left_index);
 
 	//printf("num_objes:%d\n", num_objs);
 
-	if (num_objs <= Threshold) {
+	//up to PACKET_SIZE spheres make one leaf, intersected at once
+	bool spheres = num_objs > 0 && num_objs <= SphereThreshold;
+	for (int i = left_index; spheres && i < right_index; i++)
+		spheres = is_sphere[primitives[i].index];
+
+	if (spheres) {
+		node->makeLeaf(left_index, num_objs);
+		node->setPacket(packets.size());
+		packets.push_back(SpherePacket());
+	}
+	//a node at the maximum depth becomes a (big) leaf: the traversal stack cannot hold a deeper tree
+	else if (num_objs <= Threshold || depth >= STACK_SIZE - 1) {
 		node->makeLeaf(left_index, num_objs);
 	}
 	else {
@@ -81,34 +132,27 @@ void BVH::build_recursive(int left_index, int right_index, BVHNode* node) {
 			dim = 2;
 		}
 
-		Comparator cmp;
-		cmp.dimension = dim;
-
-		sort(objects.begin() + left_index, objects.begin() + right_index, cmp);
-
-
 		float mid = (aabb.max.getAxisValue(dim) + aabb.min.getAxisValue(dim)) * 0.5;
 
-		int split_index;
+		//Split intersectables objects into left and right by partitioning around the middle of the node (O(n), no sort needed)
+		Partitioner part;
+		part.dimension = dim;
+		part.mid = mid;
 
-		//Make sure that neither left nor right is completely empty
-		if (objects[left_index]->getCentroid().getAxisValue(dim) > mid ||
-			objects[right_index - 1]->getCentroid().getAxisValue(dim) <= mid) {
-			split_index = left_index + num_objs / 2;
-		}
+		vector<BuildPrimitive>::iterator first = primitives.begin() + left_index;
+		vector<BuildPrimitive>::iterator last = primitives.begin() + right_index;
+		int split_index = partition(first, last, part) - primitives.begin();
 
+		//Make sure that neither left nor right is completely empty: fall back to a median split
+		if (split_index == left_index || split_index == right_index) {
+			Comparator cmp;
+			cmp.dimension = dim;
 
-		//Split intersectables objects into left and right by finding a split_index
-
-		else {
-			for (split_index = left_index; split_index < right_index; split_index++) {
-				if (objects[split_index]->getCentroid().getAxisValue(dim) > mid) {
-					break;
-				}
-			}
+			split_index = left_index + num_objs / 2;
+			nth_element(first, primitives.begin() + split_index, last, cmp);
 		}
 
-		//Create two new nodes, leftNode and rightNode and assign bounding boxes
+		//Compute the bounding boxes of both halves from the snapshotted bounds
 		Vector min_right, min_left;
 		min_right = Vector(FLT_MAX, FLT_MAX, FLT_MAX);
 		min_left = min_right;
@@ -116,26 +160,38 @@ void BVH::build_recursive(int left_index, int right_index, BVHNode* node) {
 		max_right = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 		max_left = max_right;
 
-		AABB leftBox = AABB(min_left, max_left);
-		AABB rightBox = AABB(min_right, max_right);
-
 		for (int left = left_index; left < split_index; left++) {
-			leftBox.extend(objects[left]->GetBoundingBox());
+			BuildPrimitive& prim = primitives[left];
+			min_left = Vector(MIN(min_left.x, prim.min.x), MIN(min_left.y, prim.min.y), MIN(min_left.z, prim.min.z));
+			max_left = Vector(MAX(max_left.x, prim.max.x), MAX(max_left.y, prim.max.y), MAX(max_left.z, prim.max.z));
 		}
 
 		for (int right = split_index; right < right_index; right++) {
-			rightBox.extend(objects[right]->GetBoundingBox());
+			BuildPrimitive& prim = primitives[right];
+			min_right = Vector(MIN(min_right.x, prim.min.x), MIN(min_right.y, prim.min.y), MIN(min_right.z, prim.min.z));
+			max_right = Vector(MAX(max_right.x, prim.max.x), MAX(max_right.y, prim.max.y), MAX(max_right.z, prim.max.z));
 		}
 
+		AABB leftBox = AABB(min_left, max_left);
+		AABB rightBox = AABB(min_right, max_right);
+
 
 		// Create two new nodes, leftNode and rightNode and assign bounding boxes
 		BVHNode* leftNode = new BVHNode();
 		BVHNode* rightNode = new BVHNode();
 
 
-		leftNode->setAABB(leftBox);
-
-		rightNode->setAABB(rightBox);
+		if (has_motion) {
+			AABB leftBox1, rightBox1;
+			motion_bounds(primitives, left_index, split_index, leftBox, leftBox1);
+			motion_bounds(primitives, split_index, right_index, rightBox, rightBox1);
+			leftNode->setAABB(leftBox, leftBox1);
+			rightNode->setAABB(rightBox, rightBox1);
+		}
+		else {
+			leftNode->setAABB(leftBox);
+			rightNode->setAABB(rightBox);
+		}
 
 		//Initiate current node as an interior node with leftNode and rightNode as children: 
 		node->makeNode(nodes.size());
@@ -144,24 +200,163 @@ void BVH::build_recursive(int left_index, int right_index, BVHNode* node) {
 		nodes.push_back(leftNode);
 		nodes.push_back(rightNode);
 
-		build_recursive(left_index, split_index, leftNode);
-		build_recursive(split_index, right_index, rightNode);
+		build_recursive(left_index, split_index, leftNode, depth + 1);
+		build_recursive(split_index, right_index, rightNode, depth + 1);
 
 	}
 
 }
 
-bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
+void BVH::pack_leaf(BVHNode* node) {
+	SpherePacket& packet = packets[node->getPacket()];
+
+	packet.count = node->getNObjs();
+	for (int i = 0; i < PACKET_SIZE; i++) {
+		//padding lanes repeat the first sphere and are masked out by count
+		Sphere* sphere = (Sphere*)objects[node->getIndex() + (i < packet.count ? i : 0)];
+		Vector center = sphere->GetCenter();
+		float radius = sphere->GetRadius();
+
+		packet.cx[i] = center.x;
+		packet.cy[i] = center.y;
+		packet.cz[i] = center.z;
+		packet.sq_radius[i] = radius * radius;
+	}
+}
+
+// Sphere::intercepts() on the spheres of a packet: the lanes whose hit distance is below t_max, with the distances in t.
+// The same operations in the same order, so the lanes give the distances intercepts() does
+int BVH::packet_hits(SpherePacket& packet, Ray& ray, float t_max, float t[PACKET_SIZE]) {
+#ifdef __AVX__
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(packet.cx), _mm256_set1_ps(ray.origin.x));
+	__m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(packet.cy), _mm256_set1_ps(ray.origin.y));
+	__m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(packet.cz), _mm256_set1_ps(ray.origin.z));
+
+	__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(ray.direction.x), ocx),
+		_mm256_mul_ps(_mm256_set1_ps(ray.direction.y), ocy)), _mm256_mul_ps(_mm256_set1_ps(ray.direction.z), ocz));
+	__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)),
+		_mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(packet.sq_radius));
+	__m256 discr = _mm256_sqrt_ps(_mm256_sub_ps(_mm256_mul_ps(b, b), c));
+
+	//outside the sphere (c > 0) the near hit, which is behind the origin when b <= 0; inside it the far one
+	__m256 outside = _mm256_cmp_ps(c, zero, _CMP_GT_OQ);
+	__m256 behind = _mm256_and_ps(outside, _mm256_cmp_ps(b, zero, _CMP_LE_OQ));
+	__m256 distance = _mm256_blendv_ps(_mm256_add_ps(b, discr), _mm256_sub_ps(b, discr), outside);
+	__m256 miss = _mm256_or_ps(behind, _mm256_cmp_ps(discr, zero, _CMP_LE_OQ));
+	__m256 hit = _mm256_andnot_ps(miss, _mm256_cmp_ps(distance, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+
+	_mm256_storeu_ps(t, distance);
+	return _mm256_movemask_ps(hit) & ((1 << packet.count) - 1);
+#else
+	int mask = 0;
+
+	for (int i = 0; i < packet.count; i++) {
+		float ocx = packet.cx[i] - ray.origin.x, ocy = packet.cy[i] - ray.origin.y, ocz = packet.cz[i] - ray.origin.z;
+		float b = ray.direction.x * ocx + ray.direction.y * ocy + ray.direction.z * ocz;
+		float c = ocx * ocx + ocy * ocy + ocz * ocz - packet.sq_radius[i];
+
+		if (c > 0.0f && b <= 0.0f)
+			continue;
+		float discr = sqrt(b * b - c);
+		if (discr <= 0.0f)
+			continue;
+		t[i] = c > 0.0f ? b - discr : b + discr;
+		if (t[i] < t_max)
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+static float surface_area(AABB& box) {
+	Vector d = box.max - box.min;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+void BVH::Refit() {
+	//the children of a node always come after it in the nodes vector
+	for (int i = nodes.size() - 1; i >= 0; i--) {
+		BVHNode* node = nodes[i];
+		AABB bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		AABB bbox1 = bbox;
+
+		if (node->isLeaf()) {
+			for (unsigned int k = node->getIndex(); k < node->getIndex() + node->getNObjs(); k++) {
+				if (has_motion && objects[k]->IsMoving()) {
+					bbox.extend(objects[k]->GetBoundingBoxAt(0.0f));
+					bbox1.extend(objects[k]->GetBoundingBoxAt(1.0f));
+				}
+				else {
+					AABB object_bbox = objects[k]->GetBoundingBox();
+					bbox.extend(object_bbox);
+					bbox1.extend(object_bbox);
+				}
+			}
+			if (node->getPacket() >= 0)
+				pack_leaf(node);
+		}
+		else {
+			bbox.extend(nodes[node->getIndex()]->getAABB(0.0f));
+			bbox.extend(nodes[node->getIndex() + 1]->getAABB(0.0f));
+			bbox1.extend(nodes[node->getIndex()]->getAABB(1.0f));
+			bbox1.extend(nodes[node->getIndex() + 1]->getAABB(1.0f));
+		}
+		if (i == 0) {  //same margin as Build()
+			bbox.min.x -= EPSILON; bbox.min.y -= EPSILON; bbox.min.z -= EPSILON;
+			bbox.max.x += EPSILON; bbox.max.y += EPSILON; bbox.max.z += EPSILON;
+			bbox1.min.x -= EPSILON; bbox1.min.y -= EPSILON; bbox1.min.z -= EPSILON;
+			bbox1.max.x += EPSILON; bbox1.max.y += EPSILON; bbox1.max.z += EPSILON;
+		}
+		node->setAABB(bbox, bbox1);
+	}
+}
+
+bool BVH::Update(float rebuild_ratio) {
+	Refit();
+	if (SAHCost() <= rebuild_ratio * build_cost)
+		return false;
+
+	vector<Object*> objs = objects;
+	for (BVHNode* node : nodes)
+		delete node;
+	nodes.clear();
+	objects.clear();
+	packets.clear();
+	Build(objs);
+	return true;
+}
+
+float BVH::SAHCost() {
+	const float traversal_cost = 1.0f, intersection_cost = 1.0f;
+	AABB root_bbox = getNodeAABB(nodes[0], 0.5f);  //bounds at mid shutter stand for the moving ones
+	float root_area = surface_area(root_bbox);
+	float cost = 0.0f;
+
+	if (root_area <= 0.0f)
+		return 0.0f;
+
+	//probability that a ray through the root visits a node: its area over the root area
+	for (BVHNode* node : nodes) {
+		AABB node_bbox = getNodeAABB(node, 0.5f);
+		float p = surface_area(node_bbox) / root_area;
+		cost += p * (node->isLeaf() ? intersection_cost * node->getNObjs() : traversal_cost);
+	}
+	return cost;
+}
+
+bool BVH::Traverse(Ray& ray, HitRecord& hit) {
 	float tmp;
 	float tmp2;
 	float tmin = FLT_MAX;  //contains the closest primitive intersection
-	bool hit = false;
 
 	Ray LocalRay = ray;
 	BVHNode* currentNode = nodes[0];
 	Object* ClosestObj = NULL;
+	HitRecord candidate;
+	TraversalStack hit_stack;
 
-	AABB bbox = currentNode->getAABB();
+	AABB bbox = getNodeAABB(currentNode, ray.time);
 
 	if (!bbox.intercepts(LocalRay, tmp)) {
 		return(false);
@@ -172,8 +367,8 @@ bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
 			int index = currentNode->getIndex();
 			BVHNode* leftChild = nodes[index];
 			BVHNode* rightChild = nodes[index + 1];
-			AABB bboxLeft = leftChild->getAABB();
-			AABB bboxRight = rightChild->getAABB();
+			AABB bboxLeft = getNodeAABB(leftChild, ray.time);
+			AABB bboxRight = getNodeAABB(rightChild, ray.time);
 
 			bool leftHit = bboxLeft.intercepts(LocalRay, tmp);
 			bool rightHit = bboxRight.intercepts(LocalRay, tmp2);
@@ -206,11 +401,27 @@ bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
 		else {
 			int index = currentNode->getIndex();
 			int numObjs = currentNode->getNObjs();
-			float curr_tmp;
-			for (int i = index; i < (index + numObjs); i++) {
-				if (objects[i]->intercepts(LocalRay, curr_tmp) && curr_tmp < tmin) {
-					tmin = curr_tmp;
+			if (currentNode->getPacket() >= 0) {
+				float t[PACKET_SIZE];
+				//the closest lane, the first one on ties as in the loop below
+				for (int mask = packet_hits(packets[currentNode->getPacket()], LocalRay, tmin, t); mask != 0; mask &= mask - 1) {
+					int lane = 0;
+					while (!(mask & (1 << lane))) lane++;
+					if (t[lane] < tmin) {
+						tmin = t[lane];
+						ClosestObj = objects[index + lane];
+						//nothing of an earlier candidate may stay in the record
+						hit = HitRecord();
+						hit.t = tmin;
+						hit.time = ray.time;
+					}
+				}
+			}
+			else for (int i = index; i < (index + numObjs); i++) {
+				if (objects[i]->intercepts(LocalRay, candidate) && candidate.t < tmin) {
+					tmin = candidate.t;
 					ClosestObj = objects[i];
+					hit = candidate;
 				}
 			}
 		}
@@ -232,8 +443,8 @@ bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
 
 		if (hit_stack.empty()) {
 			if (ClosestObj != NULL) {
-				*hit_obj = ClosestObj;
-				hit_point = ray.origin + ray.direction * tmin;
+				hit.object = ClosestObj;
+				hit.point = ray.origin + ray.direction * tmin;
 				return true;
 			}
 			else {
@@ -254,9 +465,10 @@ bool BVH::Traverse(Ray& ray) {  //shadow ray with length
 	Ray LocalRay = ray;
 	//CurrentNode = nodes[0];
 	BVHNode* currentNode = nodes[0];
+	TraversalStack hit_stack;
 	
 	//Check LocalRay intersection with Root(world box)
-	AABB bbox = currentNode->getAABB();
+	AABB bbox = getNodeAABB(currentNode, ray.time);
 	//No hit = > return false
 	if (!bbox.intercepts(LocalRay, tmp)) {
 		return(false);
@@ -269,8 +481,8 @@ bool BVH::Traverse(Ray& ray) {  //shadow ray with length
 			BVHNode* leftChild = nodes[index];
 			BVHNode* rightChild = nodes[index + 1];
 
-			AABB bboxLeft = leftChild->getAABB();
-			AABB bboxRight = rightChild->getAABB();
+			AABB bboxLeft = getNodeAABB(leftChild, ray.time);
+			AABB bboxRight = getNodeAABB(rightChild, ray.time);
 
 			//Intersection test with both child nodes
 			bool leftHit = bboxLeft.intercepts(LocalRay, tmp);
@@ -302,11 +514,16 @@ bool BVH::Traverse(Ray& ray) {  //shadow ray with length
 		//Else Is leaf
 		else {
 			int index = currentNode->getIndex();
-			float curr_tmp;
 			int numObjs = currentNode->getNObjs();
+			HitRecord hit;
+			if (currentNode->getPacket() >= 0) {
+				float t[PACKET_SIZE];
+				if (packet_hits(packets[currentNode->getPacket()], LocalRay, length, t) != 0)
+					return true;
+			}
 			//For each primitive in leaf perform intersection testing
-			for (int i = index; i < (index + numObjs); i++) {
-				if (objects[i]->intercepts(LocalRay, curr_tmp) && curr_tmp < length) {
+			else for (int i = index; i < (index + numObjs); i++) {
+				if (objects[i]->intercepts(LocalRay, hit) && hit.t < length) {
 					//Intersected => return true;
 					return true;
 				}
@@ -3,6 +3,7 @@
 
 #include <cmath>
 #include <stdio.h>
+#include <vector>
 using namespace std;
 
 #include "vector.h"
@@ -19,8 +20,41 @@ private:
 	int res_x, res_y;
 	Vector u, v, n;
 
+	// View plane point of the corner (0, 0) of the viewport relative to the eye, and the displacement of one pixel along
+	// x and y: a primary ray direction is corner + step_x * x + step_y * y. The focal_ ones are the same on the focal plane (DOF)
+	Vector corner, step_x, step_y;
+	Vector focal_corner, focal_step_x, focal_step_y;
+
+	// Pixel center directions (not normalized) split in a column and a row term: center_x[x] + center_y[y]
+	vector<Vector> center_x, center_y;
+
+	// Camera frame uvn and everything derived from it; called again whenever the eye moves
+	void UpdateFrame() {
+		n = (eye - at);
+		plane_dist = n.length();
+		n = n / plane_dist;
+		u = up % n;
+		u = u / u.length();
+		v = n % u;
+
+		step_x = u * (w / res_x);
+		step_y = v * (h / res_y);
+		corner = u * (-0.5f * w) + v * (-0.5f * h) - n * plane_dist;
+
+		// p = ps * focal_ratio on the focal plane at distance focal_ratio * plane_dist
+		focal_step_x = step_x * focal_ratio;
+		focal_step_y = step_y * focal_ratio;
+		focal_corner = corner * focal_ratio;
+
+		center_x.resize(res_x);
+		center_y.resize(res_y);
+		for (int x = 0; x < res_x; x++) center_x[x] = corner + step_x * (x + 0.5f);
+		for (int y = 0; y < res_y; y++) center_y[y] = step_y * (y + 0.5f);
+	}
+
 public:
 	Vector GetEye() { return eye; }
+	Vector GetUp() { return up; }
 	int GetResX()  { return res_x; }
     int GetResY()  { return res_y; }
 	float GetFov() { return fovy; }
@@ -39,20 +73,14 @@ public:
 	    res_y = ResY;
 		focal_ratio = Focal_ratio;
 
-        // set the camera frame uvn
-        n = ( eye - at );
-        plane_dist = n.length();
-	    n = n / plane_dist;
-
-	    u = up % n;
-	    u = u / u.length();
-
-	    v = n % u;
-
         //Dimensions of the vis window
+	    plane_dist = (eye - at).length();
 	    h = 2 * plane_dist * tan( (PI * angle / 180) / 2.0f );
         w = ( (float) res_x / res_y ) * h;  
 
+        // set the camera frame uvn
+		UpdateFrame();
+
 		aperture = Aperture_ratio * (w / res_x); //Lens aperture = aperture_ratio * pixel_size
 
 		printf("\nwidth=%f height=%f fov=%f, viewplane distance=%f, pixel size=%.3f\n", w,h, fovy,plane_dist, w/res_x);
@@ -62,61 +90,57 @@ public:
 	void SetEye(Vector from) {
 		eye = from;
 		// set the camera frame uvn
-		n = (eye - at);
-		plane_dist = n.length();
-		n = n / plane_dist;
-		u = up % n;
-		u = u / u.length();
-		v = n % u;
+		UpdateFrame();
 	}
 
 	// PRIMARY RAY: 
 	// Two important variables: point of origin (eye) and vector that defines ray direction (ray_dir)
 	Ray PrimaryRay(const Vector& pixel_sample) //  Rays cast from the Eye to a pixel sample which is in Viewport coordinates
 	{
-		Vector ps;
-		ps.x = w * (pixel_sample.x / res_x - 0.5f);
-		ps.y = h * (pixel_sample.y / res_y - 0.5f);
-		ps.z = -plane_dist;
-
-		// transform vector to world coordinates
-		Vector vX = u * ps.x;
-		Vector vY = v * ps.y;
-		Vector vZ = n * ps.z;
-
-		// normalized ray direction using vector
-		Vector ray_dir = (vX + vY + vZ).normalize();	
+		// view plane point in world coordinates: corner + pixel_sample.x * step_x + pixel_sample.y * step_y
+		Vector ray_dir = (corner + step_x * pixel_sample.x + step_y * pixel_sample.y).normalize();
 
 		return Ray(eye, ray_dir);  
 	}
 
-	Ray PrimaryRay(const Vector& lens_sample, const Vector& pixel_sample) // DOF: Rays cast from  a thin lens sample to a pixel sample
+	Ray PrimaryRay(int x, int y) // Ray through the center of the pixel (x, y), from the row and column tables
 	{
-		// coordinates at view plane distance
-		Vector ps;
-		ps.x = w * (pixel_sample.x / res_x - 0.5f );
-		ps.y = h * (pixel_sample.y / res_y - 0.5f );
-		ps.z = -plane_dist;
-
-		// pixel sample coordinates updated
-		Vector p;
-		p.x = ps.x * focal_ratio;	// focal_ratio = focalplane_distance / viewplane_distance
-		p.y = ps.y * focal_ratio;	
+		Vector ray_dir = (center_x[x] + center_y[y]).normalize();
 
-		// Ray direction [in WC] = (p - ls).normalize
-		Vector vX = u * (p.x - lens_sample.x);
-		Vector vY = v * (p.y - lens_sample.y);
+		return Ray(eye, ray_dir);
+	}
 
-		// f : focalplane_distance = focal_ratio * viewplane_distance 
-		// viewplane_distance = plane_dist
-		float f = focal_ratio * plane_dist;
-		Vector vZ = n * -f;
+	Ray PrimaryRay(const Vector& lens_sample, const Vector& pixel_sample) // DOF: Rays cast from  a thin lens sample to a pixel sample
+	{
+		// Ray direction [in WC] = (p - ls).normalize, p being the pixel sample on the focal plane
+		Vector lens_offset = (u * lens_sample.x) + (v * lens_sample.y);
+		Vector p = focal_corner + focal_step_x * pixel_sample.x + focal_step_y * pixel_sample.y;
 
-		Vector ray_dir = (vX + vY + vZ).normalize();
-		Vector eye_offset = eye + (u * lens_sample.x) + (v * lens_sample.y);
+		Vector ray_dir = (p - lens_offset).normalize();
+		Vector eye_offset = eye + lens_offset;
 
 		return Ray(eye_offset, ray_dir);
 	}
+
+	// Normalized directions of the primary rays of n pixel samples (Viewport coordinates), in SoA arrays. The loop has no
+	// branches nor calls, so the compiler vectorizes it (a whole tile of rays at a time)
+	void PrimaryDirections(int count, const float* px, const float* py, float* dir_x, float* dir_y, float* dir_z)
+	{
+		const float cx = corner.x, cy = corner.y, cz = corner.z;
+		const float sxx = step_x.x, sxy = step_x.y, sxz = step_x.z;
+		const float syx = step_y.x, syy = step_y.y, syz = step_y.z;
+
+		for (int i = 0; i < count; i++) {
+			float dx = cx + sxx * px[i] + syx * py[i];
+			float dy = cy + sxy * px[i] + syy * py[i];
+			float dz = cz + sxz * px[i] + syz * py[i];
+			float inv_length = 1.0f / sqrtf(dx * dx + dy * dy + dz * dz);
+
+			dir_x[i] = dx * inv_length;
+			dir_y[i] = dy * inv_length;
+			dir_z[i] = dz * inv_length;
+		}
+	}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include "film.h"
+#include "maths.h"
+#include "macros.h"
+
+static const int FILM_CHANNELS = 7;  //color (3), hdr (3) and weight
+
+Filter::Filter(FilterType type) {
+	switch (type) {
+	case GAUSSIAN_FILTER: radius = 1.5f; break;
+	case MITCHELL_FILTER: radius = 2.0f; break;
+	case BLACKMAN_HARRIS_FILTER: radius = 2.0f; break;
+	default: radius = 0.5f; break;
+	}
+	inv_step = TABLE_SIZE / radius;
+
+	for (int i = 0; i < TABLE_SIZE; i++) {
+		float d = (i + 0.5f) / inv_step;
+
+		switch (type) {
+		case GAUSSIAN_FILTER: {
+			// alpha = 2, shifted down to reach 0 at the radius
+			const float alpha = 2.0f;
+			table[i] = expf(-alpha * d * d) - expf(-alpha * radius * radius);
+			break;
+		}
+		case MITCHELL_FILTER: {
+			// Mitchell-Netravali cubic with B = C = 1/3: slightly negative lobes between 1 and 2 pixels sharpen the image
+			const float B = 1.0f / 3.0f, C = 1.0f / 3.0f;
+			if (d < 1.0f)
+				table[i] = ((12 - 9 * B - 6 * C) * d * d * d + (-18 + 12 * B + 6 * C) * d * d + (6 - 2 * B)) / 6;
+			else
+				table[i] = ((-B - 6 * C) * d * d * d + (6 * B + 30 * C) * d * d + (-12 * B - 48 * C) * d + (8 * B + 24 * C)) / 6;
+			break;
+		}
+		case BLACKMAN_HARRIS_FILTER: {
+			// 4 term window centered on the pixel, 1 at the center and ~0 at the radius
+			float x = PI * d / radius;
+			table[i] = 0.35875f + 0.48829f * cosf(x) + 0.14128f * cosf(2 * x) + 0.01168f * cosf(3 * x);
+			break;
+		}
+		default:
+			table[i] = 1.0f;
+			break;
+		}
+	}
+}
+
+void FilmTile::AddSample(float px, float py, Color color, Color hdr) {
+	float radius = filter->getRadius();
+
+	// pixels whose center (x + 0.5, y + 0.5) is within the radius of the sample
+	int sx0 = MAX((int)ceilf(px - 0.5f - radius), x0), sx1 = MIN((int)floorf(px - 0.5f + radius) + 1, x1);
+	int sy0 = MAX((int)ceilf(py - 0.5f - radius), y0), sy1 = MIN((int)floorf(py - 0.5f + radius) + 1, y1);
+
+	for (int y = sy0; y < sy1; y++) {
+		float wy = filter->Evaluate(y + 0.5f - py);
+		if (wy == 0.0f)
+			continue;
+
+		for (int x = sx0; x < sx1; x++) {
+			float w = wy * filter->Evaluate(x + 0.5f - px);
+			float* s = &sums[FILM_CHANNELS * ((size_t)(y - y0) * (x1 - x0) + (x - x0))];
+
+			s[0] += w * color.r();
+			s[1] += w * color.g();
+			s[2] += w * color.b();
+			s[3] += w * hdr.r();
+			s[4] += w * hdr.g();
+			s[5] += w * hdr.b();
+			s[6] += w;
+		}
+	}
+}
+
+Film::Film(int width, int height, FilterType filter)
+	: width(width), height(height), filter(filter), sums((size_t)FILM_CHANNELS * width * height) {
+	Clear();
+}
+
+void Film::Clear() {
+	for (size_t i = 0; i < sums.size(); i++)
+		sums[i].store(0.0f, memory_order_relaxed);
+}
+
+bool FilmTile::SetSums(const vector<float>& values) {
+	if (values.size() != sums.size())
+		return false;
+	sums = values;
+	return true;
+}
+
+FilmTile Film::GetTile(int x0, int y0, int x1, int y1) const {
+	FilmTile tile;
+	int margin = GetMargin();
+
+	tile.x0 = MAX(x0 - margin, 0);
+	tile.y0 = MAX(y0 - margin, 0);
+	tile.x1 = MIN(x1 + margin, width);
+	tile.y1 = MIN(y1 + margin, height);
+	tile.filter = &filter;
+	tile.sums.assign((size_t)FILM_CHANNELS * (tile.x1 - tile.x0) * (tile.y1 - tile.y0), 0.0f);
+	return tile;
+}
+
+// float add by compare and swap (no fetch_add for floats before C++20). The order of the adds does not matter and
+// ThreadPool::Run() returns after every merge, so relaxed ordering is enough
+static void atomic_add(atomic<float>& a, float v) {
+	float old = a.load(memory_order_relaxed);
+	while (!a.compare_exchange_weak(old, old + v, memory_order_relaxed))
+		;
+}
+
+void Film::MergeTile(const FilmTile& tile) {
+	for (int y = tile.y0; y < tile.y1; y++) {
+		const float* s = &tile.sums[FILM_CHANNELS * (size_t)(y - tile.y0) * (tile.x1 - tile.x0)];
+		atomic<float>* d = &sums[FILM_CHANNELS * ((size_t)y * width + tile.x0)];
+
+		for (int i = 0; i < FILM_CHANNELS * (tile.x1 - tile.x0); i++)
+			if (s[i] != 0.0f)
+				atomic_add(d[i], s[i]);
+	}
+}
+
+void Film::Resolve(int x, int y, Color& color, Color& hdr) const {
+	const atomic<float>* s = &sums[FILM_CHANNELS * ((size_t)y * width + x)];
+	float weight = s[6].load(memory_order_relaxed);
+
+	if (weight <= 0.0f) {
+		color = hdr = Color();
+		return;
+	}
+
+	// the negative lobes of the Mitchell filter may undershoot next to bright pixels
+	color = Color(s[0].load(memory_order_relaxed), s[1].load(memory_order_relaxed), s[2].load(memory_order_relaxed)) / weight;
+	color = color.clamp();
+	hdr = Color(MAX(s[3].load(memory_order_relaxed) / weight, 0.0f), MAX(s[4].load(memory_order_relaxed) / weight, 0.0f),
+		MAX(s[5].load(memory_order_relaxed) / weight, 0.0f));
+}
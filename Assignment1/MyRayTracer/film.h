@@ -0,0 +1,92 @@
+#ifndef FILM_H
+#define FILM_H
+
+#include <vector>
+#include <atomic>
+#include "color.h"
+
+using namespace std;
+
+typedef enum { BOX_FILTER, GAUSSIAN_FILTER, MITCHELL_FILTER, BLACKMAN_HARRIS_FILTER } FilterType;
+
+// --------------------------------------------------------------------- Filter
+// Pixel reconstruction filter. The filters are separable, f(dx, dy) = f(dx) f(dy), so a single table of f over
+// [0, radius) serves both axes and a sample costs two lookups instead of exp() or cos() calls
+
+class Filter
+{
+public:
+	Filter(FilterType type = BOX_FILTER);
+
+	float getRadius() const { return radius; }
+
+	//f at the distance d (either sign) from the pixel center, 0 outside the radius
+	float Evaluate(float d) const {
+		d = fabsf(d);
+		if (d >= radius)
+			return 0.0f;
+		int i = (int)(d * inv_step);
+		return table[i < TABLE_SIZE ? i : TABLE_SIZE - 1];
+	}
+
+private:
+	static const int TABLE_SIZE = 64;
+
+	float radius;
+	float inv_step;  //TABLE_SIZE / radius
+	float table[TABLE_SIZE];  //f at the middle of each step
+};
+
+// --------------------------------------------------------------------- FilmTile
+// Weighted sums of the samples of one image tile. Its pixels are the tile grown by the filter radius (clipped to the
+// image), since the samples near the border reach the pixels of the neighbouring tiles. Owned by one thread
+
+class FilmTile
+{
+public:
+	FilmTile() : x0(0), y0(0), x1(0), y1(0), filter(NULL) {}
+
+	//Sample at the image position (px, py), pixel (x, y) covering [x, x + 1) x [y, y + 1). color is the clamped sample
+	void AddSample(float px, float py, Color color, Color hdr);
+
+	//The sums, to send the tile to another process; SetSums is false when the values are not of a tile this size
+	const vector<float>& GetSums() const { return sums; }
+	bool SetSums(const vector<float>& values);
+
+private:
+	friend class Film;
+
+	int x0, y0, x1, y1;  //pixels [x0, x1) x [y0, y1)
+	const Filter* filter;
+	vector<float> sums;  //per pixel: color (3), hdr (3) and weight
+};
+
+// --------------------------------------------------------------------- Film
+// Filtered image of the file mode: every sample adds its color, weighted by the filter, to the pixels within the
+// filter radius. The tiles are traced apart and merged into the image with atomic adds, so the threads never wait on
+// a lock for the overlapping borders
+
+class Film
+{
+public:
+	Film(int width, int height, FilterType filter);
+
+	void Clear();
+
+	//Pixels a tile grows by on each side: the farthest a sample inside the tile reaches
+	int GetMargin() const { return (int)ceilf(filter.getRadius() + 0.5f); }
+
+	//Empty tile for the samples of the pixels [x0, x1) x [y0, y1)
+	FilmTile GetTile(int x0, int y0, int x1, int y1) const;
+	void MergeTile(const FilmTile& tile);
+
+	//Pixel (x, y) once every tile is merged: color is the filtered clamped samples, hdr the filtered samples
+	void Resolve(int x, int y, Color& color, Color& hdr) const;
+
+private:
+	int width, height;
+	Filter filter;
+	vector<atomic<float>> sums;  //per pixel: color (3), hdr (3) and weight
+};
+
+#endif
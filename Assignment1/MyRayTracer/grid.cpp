@@ -35,16 +35,14 @@ void Grid::Build(vector<Object*>& objs) {
 	int index;  	// cell's array index
 
 
-	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	//snapshot the objects bounds once: they are needed for the Grid BB and again for the cells insertion
+	vector<BuildPrimitive> prims;
+	AABB grid_bbox = snapshot_primitives(objs, prims);
 
-	AABB grid_bbox = AABB(min, max);
-
-	//build the Grid BB and //insert scene objects in the Grid objects list
-	for (Object* obj : objs) {
-		AABB o_bbox = obj->GetBoundingBox();
-		grid_bbox.extend(o_bbox);
+	//insert scene objects in the Grid objects list
+	for (Object* obj : objs) 
 		this->addObject(obj);
-	}
+
 	//slightly enlarge the grid box just for case
 	grid_bbox.min.x -= EPSILON; grid_bbox.min.y -= EPSILON; grid_bbox.min.z -= EPSILON;
 	grid_bbox.max.x += EPSILON; grid_bbox.max.y += EPSILON; grid_bbox.max.z += EPSILON;
@@ -72,17 +70,17 @@ void Grid::Build(vector<Object*>& objs) {
 		cells.push_back(obj_cell);   //each cell has an array with zero elements
 		
 	// insert the objects into the cells
-	for (auto &obj : objects) {   //vector iterator
+	for (auto &prim : prims) {   //vector iterator
 
-		AABB obb = obj->GetBoundingBox();
+		Object* obj = objs[prim.index];
 
 		// Compute indices of both cells that contain min and max coord of obj bbox
-		int ixmin = clamp((obb.min.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
-		int iymin = clamp((obb.min.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
-		int izmin = clamp((obb.min.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
-		int ixmax = clamp((obb.max.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
-		int iymax = clamp((obb.max.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
-		int izmax = clamp((obb.max.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
+		int ixmin = clamp((prim.min.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
+		int iymin = clamp((prim.min.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
+		int izmin = clamp((prim.min.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
+		int ixmax = clamp((prim.max.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
+		int iymax = clamp((prim.max.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
+		int izmax = clamp((prim.max.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
 
 		// add the object to the cells
 		for (int iz = izmin; iz <= izmax; iz++) 					// cells in z direction
@@ -244,7 +242,7 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 }
 
 //-----------------------------------------------------------------------GRID TRAVERSAL
-bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
+bool Grid::Traverse(Ray& ray, HitRecord& hit) {
 	int ix, iy, iz;
 	double 	tx_next, ty_next, tz_next;
 	double dtx, dty, dtz; 
@@ -258,8 +256,7 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 
 	std::vector<Object*> objs;
 	float closestDistance;
-	Object* closestObj = NULL;
-	float distance;
+	HitRecord candidate;
 	
 	while (true) {
 		objs = cells[ix + nx * iy + nx * ny * iz];
@@ -267,15 +264,15 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 		closestDistance = FLT_MAX;
 		if (objs.size() != 0) 
 			for (auto obj : objs) //intersect Ray with all objects and find the closest hit point(if any)
-				if (obj->intercepts(ray, distance) && distance < closestDistance) {
-					closestDistance = distance;
-					closestObj = obj;
+				if (obj->intercepts(ray, candidate) && candidate.t < closestDistance) {
+					closestDistance = candidate.t;
+					hit = candidate;
+					hit.object = obj;
 				}
 		
 		if (tx_next < ty_next && tx_next < tz_next) {
 			if (closestDistance < tx_next) {
-					*hitobject = closestObj;
-					hitpoint = ray.origin +ray.direction * closestDistance;
+					hit.point = ray.origin + ray.direction * closestDistance;
 					return true;
 			}
 			tx_next += dtx;
@@ -285,8 +282,7 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 
 		else if (ty_next < tz_next) {
 				if (closestDistance < ty_next) {
-					*hitobject = closestObj;
-					hitpoint = ray.origin + ray.direction * closestDistance;
+					hit.point = ray.origin + ray.direction * closestDistance;
 					return true;
 				}
 				ty_next += dty;
@@ -296,8 +292,7 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 
 		else {
 			if (closestDistance < tz_next) {
-				*hitobject = closestObj;
-				hitpoint = ray.origin + ray.direction * closestDistance;
+				hit.point = ray.origin + ray.direction * closestDistance;
 				return true;
 			}
 			tz_next += dtz;
@@ -327,14 +322,14 @@ bool Grid::Traverse(Ray& ray) {
 		return true;
 
 	std::vector<Object*> objs;
-	float distance;
+	HitRecord hit;
 
 	while (true) {
 		objs = cells[ix + nx * iy + nx * ny * iz];
 		if (objs.size() != 0) 
 			//intersect Ray with all objects of each cell
 			for (auto &obj : objs) {
-				if (obj->intercepts(ray, distance) && distance < length) 
+				if (obj->intercepts(ray, hit) && hit.t < length) 
 					return true;
 			}
 		
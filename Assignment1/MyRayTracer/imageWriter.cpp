@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <IL/il.h>
+
+#include "imageWriter.h"
+
+//64 bits file offsets: a streamed 16k x 16k PFM is 3 GB
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+#define MAX_STORED_BLOCK 65535  //largest deflate stored block
+
+mutex& devil_mutex() {
+	static mutex m;
+	return m;
+}
+
+// --------------------------------------------------------------------- PNG through DevIL
+
+bool save_png(const char* filename, int res_x, int res_y, const uint8_t* rgb) {
+	lock_guard<mutex> devil_lock(devil_mutex());
+	ILuint ImageId;
+
+	ilEnable(IL_FILE_OVERWRITE);
+	ilGenImages(1, &ImageId);
+	ilBindImage(ImageId);
+
+	ilTexImage(res_x, res_y, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, (void*)rgb /*Texture*/);
+	ilSaveImage(filename);
+
+	ilDisable(IL_FILE_OVERWRITE);
+	ilDeleteImages(1, &ImageId);
+	return ilGetError() == IL_NO_ERROR;
+}
+
+// --------------------------------------------------------------------- PFM
+// rows are stored bottom to top, as in our image buffers; the negative scale means little endian
+
+bool save_pfm(const char* filename, int res_x, int res_y, const float* rgb) {
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL) return false;
+
+	fprintf(file, "PF\n%d %d\n-1.0\n", res_x, res_y);
+	size_t n = (size_t)3 * res_x * res_y;
+	bool ok = fwrite(rgb, sizeof(float), n, file) == n;
+	return (fclose(file) == 0) && ok;
+}
+
+// --------------------------------------------------------------------- ImageWriter
+
+ImageWriter::ImageWriter(unsigned int max_queue) : max_jobs(max_queue) {
+	worker = thread(&ImageWriter::Run, this);
+}
+
+ImageWriter::~ImageWriter() {
+	{
+		lock_guard<mutex> guard(lock);
+		done = true;
+	}
+	job_added.notify_one();
+	worker.join();
+}
+
+void ImageWriter::Submit(const char* filename, int res_x, int res_y, const uint8_t* rgb) {
+	Job job;
+	job.filename = filename;
+	job.res_x = res_x;
+	job.res_y = res_y;
+	job.ldr.assign(rgb, rgb + (size_t)3 * res_x * res_y);
+	Push(job);
+}
+
+void ImageWriter::SubmitHDR(const char* filename, int res_x, int res_y, const float* rgb) {
+	Job job;
+	job.filename = filename;
+	job.res_x = res_x;
+	job.res_y = res_y;
+	job.hdr.assign(rgb, rgb + (size_t)3 * res_x * res_y);
+	Push(job);
+}
+
+void ImageWriter::Push(Job& job) {
+	unique_lock<mutex> guard(lock);
+	while (jobs.size() >= max_jobs)
+		job_removed.wait(guard);
+	jobs.push_back(move(job));
+	guard.unlock();
+	job_added.notify_one();
+}
+
+void ImageWriter::Flush() {
+	unique_lock<mutex> guard(lock);
+	while (!jobs.empty() || busy)
+		job_removed.wait(guard);
+}
+
+void ImageWriter::Run() {
+	while (true) {
+		Job job;
+		{
+			unique_lock<mutex> guard(lock);
+			while (jobs.empty() && !done)
+				job_added.wait(guard);
+			if (jobs.empty()) return;   //done and nothing left to write
+
+			job = move(jobs.front());
+			jobs.pop_front();
+			busy = true;
+		}
+		job_removed.notify_all();
+
+		bool ok;
+		if (!job.hdr.empty())
+			ok = save_pfm(job.filename.c_str(), job.res_x, job.res_y, job.hdr.data());
+		else
+			ok = save_png(job.filename.c_str(), job.res_x, job.res_y, job.ldr.data());
+
+		if (ok) printf("Image file %s created\n", job.filename.c_str());
+		else printf("Error saving Image file %s\n", job.filename.c_str());
+
+		{
+			lock_guard<mutex> guard(lock);
+			busy = false;
+		}
+		job_removed.notify_all();
+	}
+}
+
+// --------------------------------------------------------------------- PNGStreamWriter
+
+static uint32_t crc_table[256];
+
+static void make_crc_table() {
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+}
+
+static uint32_t crc32(const uint8_t* data, size_t size) {
+	uint32_t c = 0xffffffffU;
+	for (size_t i = 0; i < size; i++)
+		c = crc_table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffffU;
+}
+
+static void put_u32(vector<uint8_t>& v, uint32_t x) {
+	v.push_back((uint8_t)(x >> 24));
+	v.push_back((uint8_t)(x >> 16));
+	v.push_back((uint8_t)(x >> 8));
+	v.push_back((uint8_t)x);
+}
+
+bool PNGStreamWriter::Open(const char* filename, int res_x, int res_y) {
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+	if (crc_table[1] == 0) make_crc_table();
+
+	file = fopen(filename, "wb");
+	if (file == NULL) return false;
+
+	width = res_x;
+	remaining = (uint64_t)(1 + 3 * res_x) * res_y;
+	first_block = true;
+	adler_a = 1;
+	adler_b = 0;
+	pending.clear();
+	pending.reserve(MAX_STORED_BLOCK + 1 + 3 * res_x);
+
+	fwrite(signature, 1, 8, file);
+
+	vector<uint8_t> ihdr;
+	put_u32(ihdr, res_x);
+	put_u32(ihdr, res_y);
+	ihdr.push_back(8);   //bit depth
+	ihdr.push_back(2);   //color type: RGB
+	ihdr.push_back(0);   //deflate
+	ihdr.push_back(0);   //adaptive filtering
+	ihdr.push_back(0);   //no interlace
+	WriteChunk("IHDR", ihdr.data(), ihdr.size());
+	return true;
+}
+
+void PNGStreamWriter::WriteChunk(const char* type, const uint8_t* data, size_t size) {
+	chunk.clear();
+	put_u32(chunk, (uint32_t)size);
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data, data + size);
+	put_u32(chunk, crc32(chunk.data() + 4, size + 4));
+	fwrite(chunk.data(), 1, chunk.size(), file);
+}
+
+// one IDAT chunk per stored block; the first one starts the zlib stream and the last one ends it
+void PNGStreamWriter::WriteBlock(bool final) {
+	size_t size = final ? pending.size() : MAX_STORED_BLOCK;
+	vector<uint8_t> data;
+
+	data.reserve(size + 11);
+	if (first_block) {
+		data.push_back(0x78);   //zlib header: deflate, 32K window
+		data.push_back(0x01);
+		first_block = false;
+	}
+	data.push_back(final ? 1 : 0);   //BFINAL, BTYPE = 00 (stored)
+	data.push_back((uint8_t)size);
+	data.push_back((uint8_t)(size >> 8));
+	data.push_back((uint8_t)~size);
+	data.push_back((uint8_t)(~size >> 8));
+	data.insert(data.end(), pending.begin(), pending.begin() + size);
+	if (final) put_u32(data, (adler_b << 16) | adler_a);
+
+	WriteChunk("IDAT", data.data(), data.size());
+	pending.erase(pending.begin(), pending.begin() + size);
+}
+
+bool PNGStreamWriter::WriteRow(const uint8_t* rgb) {
+	if (file == NULL) return false;
+
+	size_t start = pending.size();
+	pending.push_back(0);   //filter type: none
+	pending.insert(pending.end(), rgb, rgb + 3 * width);
+	remaining -= pending.size() - start;
+
+	for (size_t i = start; i < pending.size(); i++) {
+		adler_a = (adler_a + pending[i]) % 65521;
+		adler_b = (adler_b + adler_a) % 65521;
+	}
+
+	while (pending.size() >= MAX_STORED_BLOCK && !(remaining == 0 && pending.size() == MAX_STORED_BLOCK))
+		WriteBlock(false);
+	return ferror(file) == 0;
+}
+
+bool PNGStreamWriter::Close() {
+	if (file == NULL) return true;
+
+	WriteBlock(true);
+	WriteChunk("IEND", NULL, 0);
+
+	bool ok = ferror(file) == 0 && remaining == 0;
+	ok = (fclose(file) == 0) && ok;
+	file = NULL;
+	return ok;
+}
+
+// --------------------------------------------------------------------- PFMStreamWriter
+
+bool PFMStreamWriter::Open(const char* filename, int res_x, int res_y) {
+	file = fopen(filename, "wb");
+	if (file == NULL) return false;
+
+	width = res_x;
+	header_size = fprintf(file, "PF\n%d %d\n-1.0\n", res_x, res_y);
+	return header_size > 0;
+}
+
+bool PFMStreamWriter::WriteRows(int y0, int n_rows, const float* rgb) {
+	if (file == NULL) return false;
+
+	size_t n = (size_t)3 * width * n_rows;
+	if (fseek64(file, header_size + (int64_t)3 * width * y0 * sizeof(float), SEEK_SET) != 0) return false;
+	return fwrite(rgb, sizeof(float), n, file) == n;
+}
+
+bool PFMStreamWriter::Close() {
+	if (file == NULL) return true;
+
+	bool ok = fclose(file) == 0;
+	file = NULL;
+	return ok;
+}
@@ -0,0 +1,102 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+//DevIL keeps a global current image, so every DevIL call sequence must hold this lock
+mutex& devil_mutex();
+
+bool save_png(const char* filename, int res_x, int res_y, const uint8_t* rgb);  //8 bits RGB through DevIL
+bool save_pfm(const char* filename, int res_x, int res_y, const float* rgb);    //32 bits float RGB Portable Float Map
+
+// Background writer: frames are copied into a bounded queue and encoded by a worker thread,
+// so the render thread can start the next frame while the previous one is being written
+
+class ImageWriter
+{
+public:
+	ImageWriter(unsigned int max_queue = 4);
+	~ImageWriter();
+
+	//copy the image and queue it; blocks only while the queue is full
+	void Submit(const char* filename, int res_x, int res_y, const uint8_t* rgb);
+	void SubmitHDR(const char* filename, int res_x, int res_y, const float* rgb);
+
+	//wait until every queued image is on disk
+	void Flush();
+
+private:
+	struct Job {
+		string filename;
+		int res_x, res_y;
+		vector<uint8_t> ldr;
+		vector<float> hdr;
+	};
+
+	void Push(Job& job);
+	void Run();
+
+	deque<Job> jobs;
+	unsigned int max_jobs;
+	bool busy = false;   //the worker is writing a job that is no longer in the queue
+	bool done = false;
+
+	mutex lock;
+	condition_variable job_added, job_removed;
+	thread worker;
+};
+
+// Streaming writers: the image is written band by band while it is rendered, so only the band being rendered
+// has to be in memory
+
+//8 bits RGB PNG written scanline by scanline, top row first, with stored (uncompressed) deflate blocks
+class PNGStreamWriter
+{
+public:
+	PNGStreamWriter() : file(NULL) {}
+	~PNGStreamWriter() { Close(); }
+
+	bool Open(const char* filename, int res_x, int res_y);
+	bool WriteRow(const uint8_t* rgb);
+	bool Close();
+
+private:
+	void WriteChunk(const char* type, const uint8_t* data, size_t size);
+	void WriteBlock(bool final);
+
+	FILE* file;
+	int width;
+	uint64_t remaining;          //raw scanline bytes still to be written
+	bool first_block;
+	uint32_t adler_a, adler_b;  //Adler-32 of the raw data
+	vector<uint8_t> pending;     //raw bytes of the next stored block
+	vector<uint8_t> chunk;
+};
+
+//32 bits float RGB PFM; bands can be written in any order since each one is placed at its own offset
+class PFMStreamWriter
+{
+public:
+	PFMStreamWriter() : file(NULL) {}
+	~PFMStreamWriter() { Close(); }
+
+	bool Open(const char* filename, int res_x, int res_y);
+	bool WriteRows(int y0, int n_rows, const float* rgb);  //rows y0 .. y0 + n_rows - 1, bottom row first
+	bool Close();
+
+private:
+	FILE* file;
+	int width;
+	long header_size;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "instance.h"
+#include "macros.h"
+
+Transform::Transform() {
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 4; j++)
+			m[i][j] = i == j ? 1.0f : 0.0f;
+}
+
+Transform::Transform(const float rows[12]) {
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 4; j++)
+			m[i][j] = rows[4 * i + j];
+}
+
+Vector Transform::Point(const Vector& p) const {
+	return Vector(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+		m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+		m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+}
+
+Vector Transform::Direction(const Vector& d) const {
+	return Vector(m[0][0] * d.x + m[0][1] * d.y + m[0][2] * d.z,
+		m[1][0] * d.x + m[1][1] * d.y + m[1][2] * d.z,
+		m[2][0] * d.x + m[2][1] * d.y + m[2][2] * d.z);
+}
+
+Vector Transform::Normal(const Vector& n) const {
+	return Vector(m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+		m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+		m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+}
+
+// inverse of the linear part by cofactors, then the translation taken back through it
+bool Transform::Inverse(Transform& inverse) const {
+	float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+	float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+	float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+	float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+
+	if (fabs(det) < 1e-12f)
+		return false;
+
+	float inv_det = 1.0f / det;
+	float (&r)[3][4] = inverse.m;
+
+	r[0][0] = c00 * inv_det;
+	r[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+	r[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+	r[1][0] = c01 * inv_det;
+	r[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+	r[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+	r[2][0] = c02 * inv_det;
+	r[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+	r[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+	for (int i = 0; i < 3; i++)
+		r[i][3] = -(r[i][0] * m[0][3] + r[i][1] * m[1][3] + r[i][2] * m[2][3]);
+	return true;
+}
+
+// world bounds: the 8 corners of the prototype bounds
+static AABB world_bounds(const Transform& to_world, const AABB& local) {
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for (int corner = 0; corner < 8; corner++) {
+		Vector p = to_world.Point(Vector(corner & 1 ? local.max.x : local.min.x, corner & 2 ? local.max.y : local.min.y,
+			corner & 4 ? local.max.z : local.min.z));
+		min = Vector(MIN(min.x, p.x), MIN(min.y, p.y), MIN(min.z, p.z));
+		max = Vector(MAX(max.x, p.x), MAX(max.y, p.y), MAX(max.z, p.z));
+	}
+	return AABB(min, max);
+}
+
+Instance::Instance(Object* prototype, const Transform& object_to_world)
+	: prototype(prototype), to_world(object_to_world) {
+	object_to_world.Inverse(to_object);
+	bbox = world_bounds(to_world, prototype->GetBoundingBox());
+}
+
+AABB Instance::GetBoundingBoxAt(float time) {
+	return IsMoving() ? world_bounds(to_world, prototype->GetBoundingBoxAt(time)) : bbox;
+}
+
+// The object space direction is normalized for the prototypes that expect it (spheres); the distance is scaled back
+bool Instance::intercepts(const Ray& r, HitRecord& hit) const {
+	Vector direction = to_object.Direction(r.direction);
+	float scale = direction.length();
+	Ray local = Ray(to_object.Point(r.origin), direction / scale, r.time);
+
+	if (!prototype->intercepts(local, hit))
+		return false;
+
+	hit.t = hit.t / scale;
+	return true;
+}
+
+// the prototype sees its hit in object space
+Vector Instance::getNormal(const HitRecord& hit) const {
+	HitRecord local = hit;
+	local.point = to_object.Point(hit.point);
+	local.object = prototype;
+
+	Vector normal = prototype->getNormal(local);
+
+	// normals go through the inverse transpose
+	normal = to_object.Normal(normal);
+	return normal.normalize();
+}
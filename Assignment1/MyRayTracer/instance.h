@@ -0,0 +1,44 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "scene.h"
+
+// --------------------------------------------------------------------- Transform
+// Affine 3x4 transform (rotation/scale/shear in the first three columns, translation in the last one)
+
+struct Transform {
+	float m[3][4];
+
+	Transform();  //identity
+	Transform(const float rows[12]);
+
+	Vector Point(const Vector& p) const;
+	Vector Direction(const Vector& d) const;   //no translation
+	Vector Normal(const Vector& n) const;      //transpose of the linear part: for normals give it the inverse transform
+	bool Inverse(Transform& inverse) const;    //false when the linear part is singular
+};
+
+// --------------------------------------------------------------------- Instance
+// Placement of shared geometry: the prototype (an imported Mesh or any other Object) is stored once and every instance
+// only holds its transform and material. The scene BVH built over the instances is the top level (TLAS); the ray is
+// taken to the object space of the prototype, where a mesh traverses its own BVH (BLAS)
+
+class Instance : public Object
+{
+public:
+	//object_to_world must be invertible (see Transform::Inverse)
+	Instance(Object* prototype, const Transform& object_to_world);
+
+	bool intercepts(const Ray& r, HitRecord& hit) const;  //the hit record of the prototype, with the world distance
+	Vector getNormal(const HitRecord& hit) const;
+	AABB GetBoundingBox(void) { return bbox; }
+	bool IsMoving() { return prototype->IsMoving(); }
+	AABB GetBoundingBoxAt(float time);
+
+private:
+	Object* prototype;
+	Transform to_world, to_object;  //object to world space and back
+	AABB bbox;
+};
+
+#endif
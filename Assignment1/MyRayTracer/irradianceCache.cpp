@@ -0,0 +1,91 @@
+#include "irradianceCache.h"
+#include "macros.h"
+
+IrradianceCache::IrradianceCache(float error, float min_spacing, float max_spacing, AABB bounds)
+	: error(error), min_spacing(min_spacing), max_spacing(max_spacing), lookups(0), hits(0) {
+	Vector size = bounds.max - bounds.min;
+	float half_size = MAX3(size.x, size.y, size.z) / 2 + EPSILON;
+
+	root = new Node(bounds.centroid(), half_size);
+}
+
+IrradianceCache::~IrradianceCache() {
+	delete root;
+}
+
+int IrradianceCache::getNumRecords() {
+	shared_lock<shared_timed_mutex> lock(mutex);
+	return records.size();
+}
+
+bool IrradianceCache::Lookup(Vector& p, Vector& n, Color& radiance) {
+	float weight_sum = 0.0f;
+	Color sum;
+
+	lookups++;
+	{
+		shared_lock<shared_timed_mutex> lock(mutex);
+		Lookup(root, p, n, weight_sum, sum);
+	}
+	if (weight_sum <= 0.0f)
+		return false;
+
+	hits++;
+	radiance = sum / weight_sum;
+	return true;
+}
+
+void IrradianceCache::Lookup(Node* node, Vector& p, Vector& n, float& weight_sum, Color& sum) {
+	for (int i : node->records) {
+		IrradianceRecord& record = records[i];
+		Vector d = p - record.point;
+
+		// the record is in front of p: it sees surfaces p does not
+		Vector mean_normal = (n + record.normal) / 2;
+		if (d * mean_normal < -0.05f * record.R)
+			continue;
+
+		float error_p = d.length() / record.R + sqrtf(MAX(0.0f, 1.0f - n * record.normal));
+		if (error_p < error) {
+			float w = 1.0f / MAX(error_p, 1e-4f);
+			weight_sum += w;
+			sum += record.radiance * w;
+		}
+	}
+
+	// the records of a child reach at most its half size outside of it
+	for (int c = 0; c < 8; c++) {
+		Node* child = node->children[c];
+		if (child == NULL)
+			continue;
+		float reach = 2 * child->half_size;
+		if (fabs(p.x - child->center.x) <= reach && fabs(p.y - child->center.y) <= reach && fabs(p.z - child->center.z) <= reach)
+			Lookup(child, p, n, weight_sum, sum);
+	}
+}
+
+void IrradianceCache::Insert(IrradianceRecord record) {
+	record.R = MIN(MAX(record.R, min_spacing), max_spacing);
+	float radius = error * record.R;  //where the weight stays above 1 / error
+
+	unique_lock<shared_timed_mutex> lock(mutex);
+	int index = records.size();
+	records.push_back(record);
+
+	Node* node = root;
+	Vector& p = record.point;
+	bool inside = fabs(p.x - root->center.x) <= root->half_size && fabs(p.y - root->center.y) <= root->half_size &&
+		fabs(p.z - root->center.z) <= root->half_size;
+
+	// deepest octant holding the point that is still as large as the validity radius
+	while (inside && node->half_size / 2 >= radius) {
+		int c = (p.x > node->center.x ? 1 : 0) | (p.y > node->center.y ? 2 : 0) | (p.z > node->center.z ? 4 : 0);
+		if (node->children[c] == NULL) {
+			float h = node->half_size / 2;
+			Vector offset = Vector(c & 1 ? h : -h, c & 2 ? h : -h, c & 4 ? h : -h);
+			node->children[c] = new Node(node->center + offset, h);
+		}
+		node = node->children[c];
+	}
+	node->records.push_back(index);
+}
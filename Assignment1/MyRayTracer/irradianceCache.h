@@ -0,0 +1,68 @@
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include "scene.h"
+
+using namespace std;
+
+// --------------------------------------------------------------------- IrradianceCache
+// Irradiance caching (Ward et al. 1988). Indirect diffuse light changes slowly over surfaces, so the hemisphere
+// integral is only computed at sparse records and interpolated elsewhere. A record at p_i with normal n_i is used at
+// (p, n) when its Ward weight 1 / (|p - p_i| / R_i + sqrt(1 - n.n_i)) is above 1 / error, R_i being the harmonic mean
+// distance to the surfaces seen from p_i: records close to other geometry cover a small area. The records live in an
+// octree; the cache is shared by the render threads and grows during the render
+
+struct IrradianceRecord {
+	Vector point;
+	Vector normal;
+	Color radiance;  //mean incoming radiance over the cosine weighted hemisphere (irradiance / PI)
+	float R;         //harmonic mean distance to the surfaces around
+};
+
+class IrradianceCache
+{
+public:
+	//error: accuracy a of the interpolation (smaller: more records). R of the records is clamped to
+	//[min_spacing, max_spacing]. bounds: region of the octree, records outside it are kept in the root
+	IrradianceCache(float error, float min_spacing, float max_spacing, AABB bounds);
+	~IrradianceCache();
+
+	//Weighted mean of the records valid at point p with normal n. False when there is none
+	bool Lookup(Vector& p, Vector& n, Color& radiance);
+	void Insert(IrradianceRecord record);
+
+	float GetMinSpacing() { return min_spacing; }
+	float GetMaxSpacing() { return max_spacing; }
+	int getNumRecords();
+
+	//Share of the lookups answered by interpolation since the last ResetStats()
+	float GetHitRate() { return lookups > 0 ? (float)hits / lookups : 0.0f; }
+	void ResetStats() { lookups = 0; hits = 0; }
+
+private:
+	struct Node {
+		Vector center;
+		float half_size;
+		vector<int> records;  //records centered in the node whose validity radius is at most half_size
+		Node* children[8];
+
+		Node(Vector c, float h) : center(c), half_size(h) { for (int i = 0; i < 8; i++) children[i] = NULL; }
+		~Node() { for (int i = 0; i < 8; i++) delete children[i]; }
+	};
+
+	void Lookup(Node* node, Vector& p, Vector& n, float& weight_sum, Color& sum);
+
+	float error;
+	float min_spacing, max_spacing;
+	vector<IrradianceRecord> records;
+	Node* root;
+	shared_timed_mutex mutex;  //lookups share it, insertions own it
+
+	atomic<unsigned long long> lookups, hits;
+};
+
+#endif
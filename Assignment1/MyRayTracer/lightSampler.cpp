@@ -0,0 +1,92 @@
+#include "lightSampler.h"
+#include "maths.h"
+#include "macros.h"
+
+void LightSampler::Build(Scene* scene) {
+	int n = scene->getNumLights();
+	float total = 0.0f;
+
+	lights.resize(n);
+	power.resize(n);
+	pdf.resize(n);
+	prob.resize(n);
+	alias.resize(n);
+
+	for (int i = 0; i < n; i++) {
+		Color& c = scene->getLight(i)->color;
+		lights[i] = scene->getLight(i);
+		power[i] = MAX(0.2126f * c.r() + 0.7152f * c.g() + 0.0722f * c.b(), 0.0f);
+		total += power[i];
+	}
+
+	// black lights only: draw them uniformly
+	for (int i = 0; i < n; i++)
+		pdf[i] = total > 0.0f ? power[i] / total : 1.0f / n;
+
+	// Vose: every cell of the table holds one light with probability prob and its alias for the rest
+	vector<int> small, large;
+	vector<float> scaled(n);
+
+	for (int i = 0; i < n; i++) {
+		scaled[i] = pdf[i] * n;
+		if (scaled[i] < 1.0f) small.push_back(i);
+		else large.push_back(i);
+	}
+	while (!small.empty() && !large.empty()) {
+		int s = small.back(), l = large.back();
+		small.pop_back();
+
+		prob[s] = scaled[s];
+		alias[s] = l;
+		scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+		if (scaled[l] < 1.0f) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// what is left is 1 up to rounding
+	for (int i : large) { prob[i] = 1.0f; alias[i] = i; }
+	for (int i : small) { prob[i] = 1.0f; alias[i] = i; }
+}
+
+int LightSampler::Sample(float u, float& light_pdf) {
+	int n = lights.size();
+	float x = u * n;
+	int cell = MIN((int)x, n - 1);
+	int i = (x - cell) < prob[cell] ? cell : alias[cell];
+
+	light_pdf = pdf[i];
+	return i;
+}
+
+Light* LightSampler::SampleRIS(Vector& point, int candidates, float& weight) {
+	Light* chosen = NULL;
+	float chosen_target = 0.0f;
+	float weight_sum = 0.0f;
+
+	weight = 0.0f;
+	if (lights.empty())
+		return NULL;
+
+	for (int c = 0; c < candidates; c++) {
+		float light_pdf;
+		int i = Sample(rand_float(), light_pdf);
+
+		Vector L = lights[i]->position - point;
+		float target = power[i] / MAX(L * L, 1e-4f);
+		float w = target / light_pdf;
+
+		// streaming selection: the candidate replaces the chosen one with probability w / weight_sum
+		weight_sum += w;
+		if (w > 0.0f && rand_float() * weight_sum < w) {
+			chosen = lights[i];
+			chosen_target = target;
+		}
+	}
+
+	if (chosen == NULL)
+		return NULL;
+
+	weight = weight_sum / (candidates * chosen_target);
+	return chosen;
+}
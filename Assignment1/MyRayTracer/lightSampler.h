@@ -0,0 +1,36 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include <vector>
+#include "scene.h"
+
+using namespace std;
+
+// --------------------------------------------------------------------- LightSampler
+// Many-light importance sampling. An alias table (Walker/Vose) draws a light with probability proportional to its
+// power in O(1) whatever the number of lights; resampled importance sampling then refines a few of those candidates
+// by their unoccluded contribution at the shaded point (power / distance^2), so the cost per hit stays constant
+
+class LightSampler
+{
+public:
+	void Build(Scene* scene);
+	int getNumLights() { return lights.size(); }
+
+	//Index of a light drawn with probability proportional to its power (pdf) from the uniform number u
+	int Sample(float u, float& pdf);
+
+	//Resampled importance sampling: draws candidates lights with Sample() and keeps one of them proportionally to
+	//power / distance^2 at the point. weight turns the contribution of the returned light into an unbiased estimate
+	//of the sum of the contributions of all the lights. NULL when no light can reach the point
+	Light* SampleRIS(Vector& point, int candidates, float& weight);
+
+private:
+	vector<Light*> lights;
+	vector<float> power;  //luminance of each light
+	vector<float> pdf;    //probability of drawing each light
+	vector<float> prob;   //alias table: probability of keeping the cell's own light...
+	vector<int> alias;    //...instead of its alias
+};
+
+#endif
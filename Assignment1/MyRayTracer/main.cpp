@@ -25,6 +25,12 @@
 #include "maths.h"
 #include "macros.h"
 #include "vector.h"
+#include "imageWriter.h"
+#include "threadPool.h"
+#include "lightSampler.h"
+#include "irradianceCache.h"
+#include "film.h"
+#include "renderFarm.h"
 
 //Enable OpenGL drawing.  
 bool drawModeEnabled = true;
@@ -33,19 +39,109 @@ bool P3F_scene = true; //choose between P3F scene or a built-in random scene
 
 #define MAX_DEPTH 7  //number of bounces
 
-#define CAPTION "Whitted Ray-Tracer"
-#define VERTEX_COORD_ATTRIB 0
-#define COLOR_ATTRIB 1
+//Integrator: WHITTED_INTEGRATOR (rayTracing) or PATH_INTEGRATOR (pathTracing, the progressive path tracer of Assignment2
+//on the CPU: diffuse, metal and dielectric scattering of the P3F materials). A path tracer needs many more samples
+#define WHITTED_INTEGRATOR 0
+#define PATH_INTEGRATOR 1
+#define INTEGRATOR WHITTED_INTEGRATOR
+#define PATH_MAX_BOUNCES 10
+#define PATH_RR_BOUNCES 3  //bounces before Russian roulette may end a path
 
-#define NSAMPLES 4
+#define CAPTION (INTEGRATOR == PATH_INTEGRATOR ? "Path Tracer" : "Whitted Ray-Tracer")
+
+#define NSAMPLES (INTEGRATOR == PATH_INTEGRATOR ? 16 : 4)
+#define SAMPLER SOBOL_SAMPLER  //RANDOM_SAMPLER, STRATIFIED_SAMPLER, SOBOL_SAMPLER or BLUE_NOISE_SAMPLER
 
 #define ANTIALIASING true
-#define	SOFTSHADOWS false
+#define	SOFTSHADOWS false  //point lights become LIGHT_SIDE x LIGHT_SIDE area lights
 #define LIGHT_SIDE 0.5
+#define AREA_LIGHT_SAMPLES (ANTIALIASING ? 1 : NSAMPLES * NSAMPLES)  //shadow rays per area light and hit
+
+//Shadow cache (antialiased hard shadows): the samples of a pixel reuse the visibility of a point light from an object
+//when their hit point lies within SHADOW_CACHE_TOLERANCE (world units) of hit points whose SHADOW_CACHE_CONFIRM traced
+//shadow rays all agreed
+#define SHADOW_CACHE true
+#define SHADOW_CACHE_TOLERANCE 0.01
+#define SHADOW_CACHE_CONFIRM 2
+#define SHADOW_CACHE_SIZE 16  //entries per thread
+
+//Indirect diffuse light: one bounce of interreflection, the mean radiance over the hemisphere of the diffuse hits
+//(INDIRECT_RAYS cosine weighted rays, a square number). The irradiance cache interpolates it from sparse estimates with
+//an error of about IRRADIANCE_CACHE_ERROR; the radii of the records are clamped to fractions of the scene size
+#define INDIRECT_DIFFUSE false
+#define INDIRECT_RAYS 64
+#define IRRADIANCE_CACHE true
+#define IRRADIANCE_CACHE_ERROR 0.3
+#define IRRADIANCE_MIN_SPACING 0.005
+#define IRRADIANCE_MAX_SPACING 0.1
 #define DOF false
 #define FUZZY_REFLECTION 0.0
 #define SKYBOX false
 
+//Many lights: above LIGHT_SAMPLING_MIN lights every hit traces LIGHT_SAMPLES shadow rays, instead of one per light, to lights
+//picked by their power and distance (resampling of LIGHT_CANDIDATES lights drawn from an alias table)
+#define LIGHT_SAMPLING true
+#define LIGHT_SAMPLING_MIN 16
+#define LIGHT_SAMPLES 4
+#define LIGHT_CANDIDATES 8
+
+//OpenGL drawing mode: trace one sample per pixel per frame and accumulate, instead of the full NSAMPLES*NSAMPLES every frame
+#define PROGRESSIVE true
+#define PROGRESSIVE_PASSES (ANTIALIASING ? NSAMPLES * NSAMPLES : 1)  //passes after which the image is converged
+
+//The image is traced in tiles of TILE_SIZE x TILE_SIZE pixels by RENDER_THREADS threads. In the OpenGL drawing mode a render
+//thread runs the passes, while the GLUT thread only handles the input and presents the finished tiles
+#define RENDER_THREADS 0  //0: one per hardware thread
+#define TILE_SIZE 32      //power of two (Morton order)
+#define PIXEL_ORDER MORTON_ORDER  //order of the pixels inside a tile: ROW_ORDER or MORTON_ORDER
+static_assert(TILE_SIZE > 0 && (TILE_SIZE & (TILE_SIZE - 1)) == 0, "TILE_SIZE must be a power of two (Morton order)");
+
+//Image file mode: instead of rendering, time the primary rays of the scene traced in row order and in Morton order
+#define BENCHMARK_PIXEL_ORDER false
+#define BENCHMARK_RUNS 5
+
+//BVH leaves of up to 8 spheres are packed and intersected at once (8 wide AVX instructions when the build targets AVX)
+#define BVH_SPHERE_PACKETS true
+
+//Image file mode: render ANIMATION_FRAMES frames (RT_Frame_000.png, ...) of the spheres bouncing instead of one image
+//(0: off). Between frames the BVH is refitted, and rebuilt once its SAH cost has grown by ANIMATION_REBUILD_RATIO
+#define ANIMATION_FRAMES 0
+#define ANIMATION_REBUILD_RATIO 1.5
+#define ANIMATION_HEIGHT 0.25  //bounce height of the spheres, at most their radius
+
+//Load the scene BENCHMARK_RUNS times with the ifstream and the memory mapped tokenizers and report the best times
+#define BENCHMARK_LOADER false
+
+//Image file mode: stop after RENDER_BUDGET_MS milliseconds with the best image reached so far (0: no limit). The samples
+//are then traced in passes of one sample per pixel, and the tiles left when the time runs out keep the previous passes
+#define RENDER_BUDGET_MS 0
+
+//Adaptive sampling (with ANTIALIASING): every pixel starts with ADAPTIVE_MIN_SAMPLES and gets more samples, up to ADAPTIVE_MAX_SAMPLES,
+//while the standard error of its luminance is above ADAPTIVE_THRESHOLD
+#define ADAPTIVE true
+#define ADAPTIVE_MIN_SAMPLES 4
+#define ADAPTIVE_MAX_SAMPLES (NSAMPLES * NSAMPLES)
+#define ADAPTIVE_THRESHOLD 0.01
+#define ADAPTIVE_DEBUG_IMAGE true  //also write the number of samples per pixel to RT_Samples.png
+
+//Pixel reconstruction filter of the image file mode (with ANTIALIASING): BOX_FILTER (mean of the samples of each pixel),
+//GAUSSIAN_FILTER, MITCHELL_FILTER or BLACKMAN_HARRIS_FILTER. The other filters splat every sample to the pixels within
+//their radius, which gives a smoother image for the same samples. The time-budgeted and streamed renders keep the box
+#define PIXEL_FILTER MITCHELL_FILTER
+
+#define HDR_OUTPUT true  //also write the unclamped image to RT_Output.pfm (32 bits float)
+#define WRITER_QUEUE 4   //frames that may wait for the background image writer
+
+//Render farm, started from the command line. "MyRayTracer -coordinator <scene> [port]" loads the scene and hands its
+//tiles out to the processes started with "MyRayTracer -worker [host] [port]" (on this machine: host 127.0.0.1), then
+//writes the image. The workers render with the box filter
+#define FARM_PORT 27015
+#define FARM_TIMEOUT 300  //seconds a worker may take to load the scene or render a batch before it is dropped
+
+//File mode: render and write the image in bands of STREAM_BAND_ROWS rows, keeping only one band in memory (very high resolutions)
+#define STREAM_OUTPUT false
+#define STREAM_BAND_ROWS 32
+
 unsigned int FrameCount = 0;
 
 // Current Camera Position
@@ -66,24 +162,62 @@ long myTime, timebase = 0, frame = 0;
 char s[32];
 
 
-// Points defined by 2 attributes: positions which are stored in vertices array and colors which are stored in colors array
-float *colors;
-float *vertices;
-int size_vertices;
-int size_colors;
+// Pixels shown in the window, RGBA8 (4 bytes per pixel). It is the persistently mapped pixel buffer when the driver
+// supports buffer storage, so the renderer writes straight into the memory the texture is updated from
+uint8_t *display_Data;
+bool display_Dirty = false;  //display_Data changed since the last texture update
 
 //Array of Pixels to be stored in a file by using DevIL library
 uint8_t *img_Data;
 
-GLfloat m[16];  //projection matrix initialized by ortho function
+//Adaptive sampling debug image: samples taken per pixel, scaled to [0, 255]
+uint8_t *samples_Data;
+
+//Unclamped pixel colors (3 floats per pixel) for the HDR output
+float *hdr_Data;
+
+//Filtered image of the file mode, NULL with the box filter
+Film* film = NULL;
+
+//Encodes and writes the image files in the background
+ImageWriter* image_writer = NULL;
+
+//Progressive refinement: running sum of the samples of each pixel (3 floats per pixel) and number of accumulated passes
+float *accum_Data;
+unsigned int accum_Passes = 0;
+
+//Threads tracing the tiles
+ThreadPool* render_pool = NULL;
+
+typedef enum { ROW_ORDER, MORTON_ORDER } PixelOrder;
+PixelOrder pixel_order = PIXEL_ORDER;
+
+//Interactive rendering. The GLUT thread posts the camera position to the render thread and cancels the pass in flight,
+//so the tiles still being traced for an older camera are dropped
+std::thread render_thread;
+std::mutex render_mutex;
+std::condition_variable render_cv;  //wakes the render thread on camera changes and on exit
+Vector render_Eye;                  //camera position requested by the GLUT thread
+unsigned int render_Generation = 0; //bumped on every camera change
+CancelToken* render_Token = NULL;   //pass in flight
+bool render_Exit = false;
+
+//Frame the render thread publishes finished tiles to (RGBA8); the GLUT thread copies it into display_Data
+uint8_t *frame_Data;
+std::mutex frame_mutex;
+bool frame_Dirty = false;  //tiles were published since the last copy
 
 GLuint VaoId;
-GLuint VboId[2];
+GLuint TextureId;
+GLuint PboId;
+GLsync PboFence = 0;  //signaled once the GPU has copied the pixel buffer into the texture
+bool PboPersistent = false;
 
 GLuint VertexShaderId, FragmentShaderId, ProgramId;
 GLint UniformId;
 
 Scene* scene = NULL;
+bool scene_motion = false;  //some object moves while the shutter is open (motion blur): every primary ray gets a time
 
 
 Grid* grid_ptr = NULL;
@@ -92,6 +226,9 @@ BVH* bvh_ptr = NULL;
 //accelerator Accel_Struct = GRID_ACC;
 accelerator Accel_Struct = BVH_ACC;
 
+LightSampler* light_sampler = NULL;
+IrradianceCache* irradiance_cache = NULL;
+
 int RES_X, RES_Y;
 
 int WindowHandle = 0;
@@ -126,16 +263,13 @@ const GLchar* VertexShader =
 {
 	"#version 430 core\n"
 
-	"in vec2 in_Position;\n"
-	"in vec3 in_Color;\n"
-	"uniform mat4 Matrix;\n"
-	"out vec4 color;\n"
+	"out vec2 tex_Coord;\n"
 
 	"void main(void)\n"
 	"{\n"
-	"	vec4 position = vec4(in_Position, 0.0, 1.0);\n"
-	"	color = vec4(in_Color, 1.0);\n"
-	"	gl_Position = Matrix * position;\n"
+	"	vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"  // full screen triangle: (-1,-1), (3,-1), (-1,3)
+	"	tex_Coord = corner;\n"
+	"	gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);\n"
 
 	"}\n"
 };
@@ -144,12 +278,13 @@ const GLchar* FragmentShader =
 {
 	"#version 430 core\n"
 
-	"in vec4 color;\n"
+	"in vec2 tex_Coord;\n"
+	"uniform sampler2D Frame;\n"
 	"out vec4 out_Color;\n"
 
 	"void main(void)\n"
 	"{\n"
-	"	out_Color = color;\n"
+	"	out_Color = texture(Frame, tex_Coord);\n"
 	"}\n"
 };
 
@@ -166,12 +301,13 @@ void createShaderProgram()
 	ProgramId = glCreateProgram();
 	glAttachShader(ProgramId, VertexShaderId);
 	glAttachShader(ProgramId, FragmentShaderId);
-
-	glBindAttribLocation(ProgramId, VERTEX_COORD_ATTRIB, "in_Position");
-	glBindAttribLocation(ProgramId, COLOR_ATTRIB, "in_Color");
 	
 	glLinkProgram(ProgramId);
-	UniformId = glGetUniformLocation(ProgramId, "Matrix");
+	UniformId = glGetUniformLocation(ProgramId, "Frame");
+
+	glUseProgram(ProgramId);
+	glUniform1i(UniformId, 0);  //texture unit 0
+	glUseProgram(0);
 
 	checkOpenGLError("ERROR: Could not create shaders.");
 }
@@ -189,88 +325,109 @@ void destroyShaderProgram()
 	checkOpenGLError("ERROR: Could not destroy shaders.");
 }
 
-/////////////////////////////////////////////////////////////////////// VAOs & VBOs
+/////////////////////////////////////////////////////////////////////// VAO, TEXTURE & PBO
 
 void createBufferObjects()
 {
+	GLsizeiptr size = 4 * (GLsizeiptr)RES_X * RES_Y;
+
+	// the full screen triangle has no vertex attributes, but the core profile still needs a VAO bound
 	glGenVertexArrays(1, &VaoId);
-	glBindVertexArray(VaoId);
-	glGenBuffers(2, VboId);
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[0]);
-
-	/* S se faz a alocao dos arrays glBufferData (NULL), e o envio dos pontos para a placa grfica
-	 feito na drawPoints com GlBufferSubData em tempo de execuo pois os arrays so GL_DYNAMIC_DRAW */
-	glBufferData(GL_ARRAY_BUFFER, size_vertices, NULL, GL_DYNAMIC_DRAW);
-	glEnableVertexAttribArray(VERTEX_COORD_ATTRIB);
-	glVertexAttribPointer(VERTEX_COORD_ATTRIB, 2, GL_FLOAT, 0, 0, 0);
-	
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[1]);
-	glBufferData(GL_ARRAY_BUFFER, size_colors, NULL, GL_DYNAMIC_DRAW);
-	glEnableVertexAttribArray(COLOR_ATTRIB);
-	glVertexAttribPointer(COLOR_ATTRIB, 3, GL_FLOAT, 0, 0, 0);
-	
-// unbind the VAO
-	glBindVertexArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-//	glDisableVertexAttribArray(VERTEX_COORD_ATTRIB); 
-//	glDisableVertexAttribArray(COLOR_ATTRIB);
-	checkOpenGLError("ERROR: Could not create VAOs and VBOs.");
+
+	glGenTextures(1, &TextureId);
+	glBindTexture(GL_TEXTURE_2D, TextureId);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, RES_X, RES_Y);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	PboPersistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+	if (PboPersistent) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		glGenBuffers(1, &PboId);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PboId);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+		display_Data = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	else {
+		// no buffer storage: the texture is updated from client memory
+		display_Data = (uint8_t*)malloc(size);
+	}
+	if (display_Data == NULL) {
+		std::cerr << "ERROR: Could not allocate the display buffer." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	memset(display_Data, 0, size);
+
+	checkOpenGLError("ERROR: Could not create the VAO, texture and pixel buffer.");
 }
 
 void destroyBufferObjects()
 {
-	glDisableVertexAttribArray(VERTEX_COORD_ATTRIB);
-	glDisableVertexAttribArray(COLOR_ATTRIB);
-	
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
+	if (PboPersistent) {
+		if (PboFence) glDeleteSync(PboFence);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PboId);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &PboId);
+	}
+	else {
+		free(display_Data);
+	}
+	display_Data = NULL;
 
-	glDeleteBuffers(1, VboId);
+	glDeleteTextures(1, &TextureId);
 	glDeleteVertexArrays(1, &VaoId);
-	checkOpenGLError("ERROR: Could not destroy VAOs and VBOs.");
+	checkOpenGLError("ERROR: Could not destroy the VAO, texture and pixel buffer.");
+}
+
+// The renderer must not overwrite the pixel buffer while the GPU is still copying it into the texture
+void waitDisplayBuffer()
+{
+	if (PboFence) {
+		while (glClientWaitSync(PboFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(PboFence);
+		PboFence = 0;
+	}
 }
 
-void drawPoints()
+// Update the texture with the frame (only when it changed) and draw it with a single full screen triangle
+void drawFrame()
 {
 	FrameCount++;
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	glBindVertexArray(VaoId);
-	glUseProgram(ProgramId);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, TextureId);
 
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[0]);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, size_vertices, vertices);
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[1]);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, size_colors, colors);
+	if (display_Dirty) {
+		if (PboPersistent) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PboId);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RES_X, RES_Y, GL_RGBA, GL_UNSIGNED_BYTE, 0);  //offset 0 in the PBO
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			PboFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		else {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RES_X, RES_Y, GL_RGBA, GL_UNSIGNED_BYTE, display_Data);
+		}
+		display_Dirty = false;
+	}
 
-	glUniformMatrix4fv(UniformId, 1, GL_FALSE, m);
-	glDrawArrays(GL_POINTS, 0, RES_X*RES_Y);
-	glFinish();
+	glBindVertexArray(VaoId);
+	glUseProgram(ProgramId);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
 
 	glUseProgram(0);
 	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
 
 	checkOpenGLError("ERROR: Could not draw scene.");
 }
 
-ILuint saveImgFile(const char *filename) {
-	ILuint ImageId;
-
-	ilEnable(IL_FILE_OVERWRITE);
-	ilGenImages(1, &ImageId);
-	ilBindImage(ImageId);
-
-	ilTexImage(RES_X, RES_Y, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, img_Data /*Texture*/);
-	ilSaveImage(filename);
-
-	ilDisable(IL_FILE_OVERWRITE);
-	ilDeleteImages(1, &ImageId);
-	if (ilGetError() != IL_NO_ERROR)return ilGetError();
-
-	return IL_NO_ERROR;
-}
-
 /////////////////////////////////////////////////////////////////////// CALLBACKS
 
 void timer(int value)
@@ -292,32 +449,10 @@ void cleanup()
 	destroyBufferObjects();
 }
 
-void ortho(float left, float right, float bottom, float top, 
-			float nearp, float farp)
-{
-	m[0 * 4 + 0] = 2 / (right - left);
-	m[0 * 4 + 1] = 0.0;
-	m[0 * 4 + 2] = 0.0;
-	m[0 * 4 + 3] = 0.0;
-	m[1 * 4 + 0] = 0.0;
-	m[1 * 4 + 1] = 2 / (top - bottom);
-	m[1 * 4 + 2] = 0.0;
-	m[1 * 4 + 3] = 0.0;
-	m[2 * 4 + 0] = 0.0;
-	m[2 * 4 + 1] = 0.0;
-	m[2 * 4 + 2] = -2 / (farp - nearp);
-	m[2 * 4 + 3] = 0.0;
-	m[3 * 4 + 0] = -(right + left) / (right - left);
-	m[3 * 4 + 1] = -(top + bottom) / (top - bottom);
-	m[3 * 4 + 2] = -(farp + nearp) / (farp - nearp);
-	m[3 * 4 + 3] = 1.0;
-}
-
 void reshape(int w, int h)
 {
     glClear(GL_COLOR_BUFFER_BIT);
 	glViewport(0, 0, w, h);
-	ortho(0, (float)RES_X, 0, (float)RES_Y, -1.0, 1.0);
 }
 
 void processKeys(unsigned char key, int xx, int yy)
@@ -525,147 +660,381 @@ void schlik(Vector& I, Vector& nHit, float& ior, float& kr, float ior2) {
 }
 
 
-Color rayTracing(Ray ray, int depth, float ior_1,int offsetX, int offsetY)  //index of refraction of medium 1 where the ray is travelling
+// Shadow cache of the calling thread for the pixel it is tracing: visibility of a point light from a hit point of an object
+
+struct ShadowCacheEntry {
+	Object* object;
+	Light* light;
+	Vector point;
+	bool occluded;
+	int traced;  //shadow rays that agreed on occluded
+	bool mixed;  //shadow rays that disagreed: a shadow edge crosses the pixel, keep tracing
+};
+
+struct ShadowCache {
+	unsigned int generation;
+	int x, y;     //pixel
+	int count, next;
+	ShadowCacheEntry entries[SHADOW_CACHE_SIZE];
+	unsigned long long lookups, hits;  //not yet added to the totals
+};
+
+static thread_local ShadowCache shadow_cache;
+std::atomic<unsigned int> shadow_cache_generation(1);  //bumped for every scene: the cached objects and lights are gone
+std::atomic<unsigned long long> shadow_cache_lookups(0), shadow_cache_hits(0);
+
+// Drop every cached entry (new scene)
+void shadowCacheReset()
 {
-	Color color = Color();
+	shadow_cache_generation++;
+	shadow_cache_lookups = shadow_cache_hits = 0;
+}
 
-	Vector pHit; // intersection point
-	Vector nHit; // normal in pHit
+// Start caching for the pixel (x, y); the entries of another pixel are dropped
+void shadowCachePixel(int x, int y)
+{
+	ShadowCache& cache = shadow_cache;
+
+	if (cache.x == x && cache.y == y && cache.generation == shadow_cache_generation)
+		return;
+
+	shadow_cache_lookups += cache.lookups;
+	shadow_cache_hits += cache.hits;
+	cache.lookups = cache.hits = 0;
+	cache.generation = shadow_cache_generation;
+	cache.x = x;
+	cache.y = y;
+	cache.count = cache.next = 0;
+}
 
-	Object* object = NULL;
-	float minDist = FLT_MAX;
-	float t;
+// Entry of the light and the object for a point within SHADOW_CACHE_TOLERANCE of point, NULL if there is none
+ShadowCacheEntry* shadowCacheFind(Object* object, Light* light, Vector& point)
+{
+	ShadowCache& cache = shadow_cache;
+	const float tolerance2 = SHADOW_CACHE_TOLERANCE * SHADOW_CACHE_TOLERANCE;
+
+	for (int i = 0; i < cache.count; i++) {
+		ShadowCacheEntry& entry = cache.entries[i];
+		if (entry.object == object && entry.light == light) {
+			Vector d = entry.point - point;
+			if (d * d <= tolerance2)
+				return &entry;
+		}
+	}
+	return NULL;
+}
+
+// Visibility of the light from the point of the object, when SHADOW_CACHE_CONFIRM shadow rays traced from nearby points
+// of the same pixel agreed on it. Pixels crossed by a shadow edge never reuse, so the antialiasing of the edge is kept
+bool shadowCacheLookup(Object* object, Light* light, Vector& point, bool& occluded)
+{
+	ShadowCacheEntry* entry = shadowCacheFind(object, light, point);
+
+	shadow_cache.lookups++;
+	if (entry == NULL || entry->mixed || entry->traced < SHADOW_CACHE_CONFIRM)
+		return false;
+
+	occluded = entry->occluded;
+	shadow_cache.hits++;
+	return true;
+}
+
+// Record the result of a traced shadow ray
+void shadowCacheStore(Object* object, Light* light, Vector& point, bool occluded)
+{
+	ShadowCache& cache = shadow_cache;
+	ShadowCacheEntry* entry = shadowCacheFind(object, light, point);
+
+	if (entry != NULL) {
+		if (entry->occluded != occluded) entry->mixed = true;
+		else entry->traced++;
+		return;
+	}
+
+	entry = &cache.entries[cache.next];
+	entry->object = object;
+	entry->light = light;
+	entry->point = point;
+	entry->occluded = occluded;
+	entry->traced = 1;
+	entry->mixed = false;
+
+	cache.next = (cache.next + 1) % SHADOW_CACHE_SIZE;  //the oldest entry goes first
+	cache.count = MAX(cache.count, cache.next == 0 ? SHADOW_CACHE_SIZE : cache.next);
+}
+
+// Point (u, v) of the unit square for the s-th of the n sample points of an area light at a hit: one jittered point in
+// each cell of a k x k grid (k = sqrt(n)), random points past k * k. A single sample per hit comes from the pixel sampler,
+// so it is stratified across the samples of the pixel instead
+
+void areaLightSample(int s, int n, float& u, float& v)
+{
+	int k = (int)sqrtf((float)n);
+
+	if (n == 1 && ANTIALIASING) {
+		thread_sampler()->Get2D(u, v);
+	}
+	else if (s < k * k) {
+		u = ((s / k) + rand_float()) / k;
+		v = ((s % k) + rand_float()) / k;
+	}
+	else {
+		u = rand_float();
+		v = rand_float();
+	}
+}
+
+// Set while the calling thread traces the hemisphere rays of an indirect light estimate: their hits do not gather indirect
+// light again (one bounce) and do not belong to the pixel of the shadow cache
+static thread_local bool indirect_gathering = false;
 
-	Vector L;
+// Light reaching the hit point pHit (normal nHit) of the ray from a point at lightPos of the light: shadow ray (or the
+// shadow cache), then the diffuse and specular (Blinn-Phong) terms. Area lights call it for every sample point
+
+Color directLight(Object* object, Ray& ray, Vector& pHit, Vector& nHit, Light* light, Vector& lightPos, Color& light_color, int num_lights)
+{
+	Color color = Color();
 	int num_objects = scene->getNumObjects();
-	int num_lights = scene->getNumLights();
 
-	Light* light;
+	// L vector: from point intersection to light source
+	Vector L = lightPos - pHit;
 
-	if (Accel_Struct == GRID_ACC) {
-		// There is no intersection points
-		if (!grid_ptr->Traverse(ray, &object, pHit)) {
-			object = NULL;
+	Vector Lnormal = L;
+	Lnormal = Lnormal.normalize();
+
+	bool inShadow = false;
+
+	Vector I = ray.direction * -1;
+	float cosI = I * nHit;
+
+	float tNear = L.length();
+	//int index;
+
+	// avoid acne effect
+	Vector shadowRayOrigin = pHit + Lnormal * EPSILON;
+
+	// Secondary Shadow Ray
+	Ray shadowRay = Ray(shadowRayOrigin, Lnormal, ray.time);
+
+	// hard shadows only: the point of an area light changes from sample to sample, and so do the occluders of a scene
+	// with motion
+	bool cacheable = SHADOW_CACHE && !light->IsArea() && !indirect_gathering && !scene_motion;
+	bool cached = cacheable && shadowCacheLookup(object, light, pHit, inShadow);
+
+	if (cached) {
+		// visibility reused from a previous sample of the pixel
+	}
+	else if (Accel_Struct == GRID_ACC) {
+
+		shadowRay = Ray(shadowRayOrigin, L, ray.time);
+
+		// for shadow rays
+		if (grid_ptr->Traverse(shadowRay)) {
+			inShadow = true;
 		}
 	}
 	else if (Accel_Struct == BVH_ACC) {
-		// There is no intersection points
-		if (!bvh_ptr->Traverse(ray, &object, pHit)) {
-			object = NULL;
+
+		shadowRay = Ray(shadowRayOrigin, L, ray.time);
+
+		// for shadow rays
+		if (bvh_ptr->Traverse(shadowRay)) {
+			inShadow = true;
 		}
 	}
-
-	// no acceleration structure
 	else {
-		// search for intersections -> choose closest object
-		for (int k = 0; k < num_objects; k++) {
-			Object* obj = scene->getObject(k);
-			if (obj->intercepts(ray, t)) {
-
-				if (t < minDist) {
-					minDist = t;
-					object = scene->getObject(k);
+		// Ray hits from outside of object
+		if (cosI > 0) {
+
+			// check if object is in shadow or not
+			HitRecord hit;
+			for (int s = 0; s < num_objects; s++) {
+
+				// Object in shadow
+				if (scene->getObject(s)->intercepts(shadowRay, hit) && (hit.t < tNear)) {
+					//index = s;			// save object that has been intersected
+					inShadow = true;
+					break;
 				}
 			}
 		}
-		pHit = ray.origin + ray.direction * minDist;
 	}
 
-	// If there was an object that collided with the ray
-	if (object != NULL) {
+	if (cacheable && !cached)
+		shadowCacheStore(object, light, pHit, inShadow);
 
-		float transmitanceFlag = object->GetMaterial()->GetTransmittance();
-		float reflectiveFlag = object->GetMaterial()->GetReflection();
-		float refrIndex = object->GetMaterial()->GetRefrIndex();
+	// Calculate color when not in shadow. Else pixel is not colored
+	if (!inShadow) {
+		Vector H = (Lnormal + I).normalize();
 
-		nHit = object->getNormal(pHit);
+		// heuristic to calculate attenuation index
+		float k1 = 1.25;
+		float katt = 1 / (k1 * num_lights); // attenuation index
 
-		for (int j = 0; j < num_lights; j++) {
+		Color diff = light_color * object->GetMaterial()->GetDiffuse() * object->GetMaterial()->GetDiffColor() * max((nHit * Lnormal), 0.0f);
+		Color spec = light_color * object->GetMaterial()->GetSpecular() * object->GetMaterial()->GetSpecColor() * pow(max((nHit * H), 0.0f), object->GetMaterial()->GetShine());
+		color = diff + (spec * katt);
+	}
+	return color;
+}
+
+
+Color rayTracing(Ray ray, int depth, float ior_1, float* hit_dist = NULL);
+
+// Closest hit of the ray, through the acceleration structure in use. Nothing is shaded yet: the normal is asked for
+// this hit alone, with getNormal(hit)
+bool closestHit(Ray& ray, HitRecord& hit)
+{
+	if (Accel_Struct == GRID_ACC) {
+		return grid_ptr->Traverse(ray, hit);
+	}
+	else if (Accel_Struct == BVH_ACC) {
+		return bvh_ptr->Traverse(ray, hit);
+	}
+
+	// no acceleration structure
+	float minDist = FLT_MAX;
+	HitRecord candidate;
+
+	// search for intersections -> choose closest object
+	hit.object = NULL;
+	for (int k = 0; k < scene->getNumObjects(); k++) {
+		Object* obj = scene->getObject(k);
+		if (obj->intercepts(ray, candidate) && candidate.t < minDist) {
+			minDist = candidate.t;
+			hit = candidate;
+			hit.object = obj;
+		}
+	}
+	hit.point = ray.origin + ray.direction * minDist;
+	return hit.object != NULL;
+}
+
+// Light reaching the hit point pHit (normal nHit) of the ray from every light of the scene (or from the sampled ones)
+Color lightRadiance(Object* object, Ray& ray, Vector& pHit, Vector& nHit)
+{
+	Color color = Color();
+	int num_lights = scene->getNumLights();
+	Light* light;
+
+	// many lights: a fixed number of shadow rays, each weighted to estimate the sum over all the lights
+	bool sample_lights = LIGHT_SAMPLING && num_lights > LIGHT_SAMPLING_MIN;
+	int num_shadow_rays = sample_lights ? LIGHT_SAMPLES : num_lights;
+
+	for (int j = 0; j < num_shadow_rays; j++) {
+		float light_weight = 1.0f;
+
+		if (sample_lights) {
+			light = light_sampler->SampleRIS(pHit, LIGHT_CANDIDATES, light_weight);
+			if (light == NULL)
+				continue;
+			light_weight /= LIGHT_SAMPLES;
+		}
+		else
 			light = scene->getLight(j);
 
-			if (SOFTSHADOWS && ANTIALIASING) {
-				float offX = offsetX * 1.0;
-				float offY = offsetY * 1.0;
+		// area lights: AREA_LIGHT_SAMPLES stratified points, each one a point light with its share of the color
+		int n_points = light->IsArea() ? AREA_LIGHT_SAMPLES : 1;
+		Color light_color = light->color * (light_weight / n_points);
 
-				Vector position = Vector(
-					light->position.x + LIGHT_SIDE * (offX + rand_float()) / NSAMPLES,
-					light->position.y + LIGHT_SIDE * (offY + rand_float()) / NSAMPLES,
-					light->position.z);
+		for (int s = 0; s < n_points; s++) {
+			Vector position = light->position;
 
-				L = position - pHit;
-			}
-			else {
-			
-				// L vector: from point intersection to light source
-				L = light->position - pHit;
+			if (light->IsArea()) {
+				float u, v;
+				areaLightSample(s, n_points, u, v);
+				position = light->SamplePoint(u, v, pHit);
 			}
+			color += directLight(object, ray, pHit, nHit, light, position, light_color, num_lights);
+		}
+	}
+	return color;
+}
 
-			Vector Lnormal = L;
-			Lnormal = Lnormal.normalize();
+// Mean radiance reaching p from the hemisphere around n, from INDIRECT_RAYS stratified cosine weighted rays, and the
+// harmonic mean distance R of the surfaces they hit (FLT_MAX when every ray escapes). The rays keep the time of the ray
+// that hit p
+Color hemisphereRadiance(Vector& p, Vector& n, int depth, float ior_1, float time, float& R)
+{
+	int k = MAX((int)sqrtf((float)INDIRECT_RAYS), 1);
+	Color sum = Color();
+	float inv_dist = 0.0f;
+
+	// orthonormal basis around n
+	Vector t = fabs(n.x) > 0.9f ? Vector(0.0f, 1.0f, 0.0f) : Vector(1.0f, 0.0f, 0.0f);
+	Vector b = (n % t).normalize();
+	t = b % n;
+	Vector origin = p + n * EPSILON;
+
+	indirect_gathering = true;
+	for (int i = 0; i < k; i++) {
+		for (int j = 0; j < k; j++) {
+			// cosine weighted: uniform on the disk, projected up on the hemisphere
+			Vector d = rnd_unit_disk((i + rand_float()) / k, (j + rand_float()) / k);
+			float z = sqrtf(MAX(0.0f, 1.0f - d.x * d.x - d.y * d.y));
+			Vector dir = t * d.x + b * d.y + n * z;
+			float dist;
+
+			sum += rayTracing(Ray(origin, dir, time), depth + 1, ior_1, &dist);
+			inv_dist += 1.0f / dist;
+		}
+	}
+	indirect_gathering = false;
 
-			float distLight;
-			bool inShadow = false;
+	R = inv_dist > 0.0f ? (k * k) / inv_dist : FLT_MAX;
+	return sum / (float)(k * k);
+}
 
-			Vector I = ray.direction * -1;
-			float cosI = I * nHit;
+// Incoming indirect radiance at p (normal n facing the ray): interpolated from the irradiance cache, or estimated and
+// added to it. The cache ignores the time: with motion blur its records hold the radiance at the time they were made
+Color indirectDiffuse(Vector& p, Vector& n, int depth, float ior_1, float time)
+{
+	Color radiance;
+	float R;
 
-			float tNear = L.length();
-			//int index;
+	if (IRRADIANCE_CACHE && irradiance_cache != NULL && irradiance_cache->Lookup(p, n, radiance))
+		return radiance;
 
-			// avoid acne effect
-			Vector shadowRayOrigin = pHit + Lnormal * EPSILON;
+	radiance = hemisphereRadiance(p, n, depth, ior_1, time, R);
+	if (IRRADIANCE_CACHE && irradiance_cache != NULL) {
+		IrradianceRecord record = { p, n, radiance, R };
+		irradiance_cache->Insert(record);
+	}
+	return radiance;
+}
 
-			// Secondary Shadow Ray
-			Ray shadowRay = Ray(shadowRayOrigin, Lnormal);
+// Radiance along the ray. hit_dist, when given, gets the distance to the hit (FLT_MAX when it escapes)
+Color rayTracing(Ray ray, int depth, float ior_1, float* hit_dist)  //index of refraction of medium 1 where the ray is travelling
+{
+	Color color = Color();
 
-			if (Accel_Struct == GRID_ACC) {
+	Vector pHit; // intersection point
+	Vector nHit; // normal in pHit
 
-				shadowRay = Ray(shadowRayOrigin, L);
+	HitRecord hit;
+	Object* object = closestHit(ray, hit) ? hit.object : NULL;
 
-				// for shadow rays
-				if (grid_ptr->Traverse(shadowRay)) {
-					inShadow = true;
-				}
-			}
-			else if (Accel_Struct == BVH_ACC) {
+	pHit = hit.point;
 
-				shadowRay = Ray(shadowRayOrigin, L);
+	if (hit_dist != NULL)
+		*hit_dist = object != NULL ? (pHit - ray.origin).length() : FLT_MAX;
 
-				// for shadow rays
-				if (bvh_ptr->Traverse(shadowRay)) {
-					inShadow = true;
-				}
-			}
-			else {
-				// Ray hits from outside of object
-				if (cosI > 0) {
-
-					// check if object is in shadow or not
-					for (int s = 0; s < num_objects; s++) {
-
-						// Object in shadow
-						if (scene->getObject(s)->intercepts(shadowRay, distLight) && (distLight < tNear)) {
-							//index = s;			// save object that has been intersected
-							inShadow = true;
-							break;
-						}
-					}
-				}
-			}
-			
+	// If there was an object that collided with the ray
+	if (object != NULL) {
 
-			// Calculate color when not in shadow. Else pixel is not colored
-			if (!inShadow) {
-				Vector H = (Lnormal + I).normalize();
+		float transmitanceFlag = object->GetMaterial()->GetTransmittance();
+		float reflectiveFlag = object->GetMaterial()->GetReflection();
+		float refrIndex = object->GetMaterial()->GetRefrIndex();
 
-				// heuristic to calculate attenuation index
-				float k1 = 1.25;
-				float katt = 1 / (k1 * num_lights); // attenuation index
+		nHit = object->getNormal(hit);
 
-				Color diff = scene->getLight(j)->color * object->GetMaterial()->GetDiffuse() * object->GetMaterial()->GetDiffColor() * max((nHit * Lnormal), 0.0f);
-				Color spec = scene->getLight(j)->color * object->GetMaterial()->GetSpecular() * object->GetMaterial()->GetSpecColor() * pow(max((nHit * H), 0.0f), object->GetMaterial()->GetShine());
-				color += diff + (spec * katt);
-			}
+		color += lightRadiance(object, ray, pHit, nHit);
+
+		// one bounce of indirect light on the diffuse surfaces (Lambertian: albedo times the mean incoming radiance)
+		float diffuse = object->GetMaterial()->GetDiffuse();
+		if (INDIRECT_DIFFUSE && diffuse > 0.0f && !indirect_gathering) {
+			Vector nFacing = ray.direction * nHit > 0.0f ? nHit * -1 : nHit;
+			color += indirectDiffuse(pHit, nFacing, depth, ior_1, ray.time) * object->GetMaterial()->GetDiffColor() * diffuse;
 		}
 
 		if (depth >= MAX_DEPTH) {
@@ -723,8 +1092,8 @@ Color rayTracing(Ray ray, int depth, float ior_1,int offsetX, int offsetY)  //in
 				refractionOrigin = pHit + nAux * EPSILON;
 			}
 			
-			Ray rayRefraction = Ray(refractionOrigin, refractionDir);
-			Color refractionColor = rayTracing(rayRefraction, depth + 1, ior_1, offsetX, offsetY);
+			Ray rayRefraction = Ray(refractionOrigin, refractionDir, ray.time);
+			Color refractionColor = rayTracing(rayRefraction, depth + 1, ior_1);
 
 			color += refractionColor * (1 - kReflection);
 
@@ -752,8 +1121,8 @@ Color rayTracing(Ray ray, int depth, float ior_1,int offsetX, int offsetY)  //in
 				reflectionOrigin = pHit - nHit * EPSILON;
 			}
 
-			Ray rayReflection = Ray(reflectionOrigin, reflectionDir);
-			Color reflectionColor = rayTracing(rayReflection, depth + 1, ior_1, offsetX, offsetY);
+			Ray rayReflection = Ray(reflectionOrigin, reflectionDir, ray.time);
+			Color reflectionColor = rayTracing(rayReflection, depth + 1, ior_1);
 
 			color += reflectionColor * object->GetMaterial()->GetReflection() * object->GetMaterial()->GetSpecColor();
 		}
@@ -768,127 +1137,884 @@ Color rayTracing(Ray ray, int depth, float ior_1,int offsetX, int offsetY)  //in
 }
 
 
-// Render function by primary ray casting from the eye towards the scene's objects
+// 2D sample of a path vertex: from the pixel sampler, which stratifies it across the samples of the pixel, when there is
+// one
+void pathSample2D(float& u, float& v)
+{
+	if (ANTIALIASING)
+		thread_sampler()->Get2D(u, v);
+	else {
+		u = rand_float();
+		v = rand_float();
+	}
+}
 
-void renderScene()
+// Schlick approximation of the Fresnel reflectance, light arriving from the air
+float schlick(float cosine, float ior)
 {
-	int index_pos = 0;
-	int index_col = 0;
-	unsigned int counter = 0;
+	float r0 = (1.0f - ior) / (1.0f + ior);
+	r0 = r0 * r0;
+	return r0 + (1.0f - r0) * powf(1.0f - cosine, 5.0f);
+}
+
+// Radiance along the ray by path tracing (the scatter() of Assignment2). At every hit the lights are sampled as in
+// rayTracing() and the path goes on in one direction: a P3F material with transmittance is a dielectric (Schlick
+// reflection or refraction); any other one mixes a diffuse lobe (Kd * diffuse color, cosine weighted directions) and a
+// metal lobe (Ks * specular color, mirror direction blurred by FUZZY_REFLECTION), chosen in proportion to their weights.
+// Its expectation is the Whitted image plus the indirect light between diffuse surfaces
+Color pathTracing(Ray ray)
+{
+	Color color = Color();
+	Color throughput = Color(1.0f, 1.0f, 1.0f);
+
+	for (int bounce = 0; bounce < PATH_MAX_BOUNCES; bounce++) {
+		HitRecord hit;
+
+		if (!closestHit(ray, hit)) {
+			color += throughput * (SKYBOX ? scene->GetSkyboxColor(ray) : scene->GetBackgroundColor());
+			break;
+		}
+
+		Object* object = hit.object;
+		Vector pHit = hit.point;
+		Material* material = object->GetMaterial();
+		Vector nHit = object->getNormal(hit);
+		Vector V = ray.direction;
+		Vector direction;
+		float cosi = V * nHit;
+
+		color += throughput * lightRadiance(object, ray, pHit, nHit);
 
-	if (drawModeEnabled) {
-		glClear(GL_COLOR_BUFFER_BIT);
-		scene->GetCamera()->SetEye(Vector(camX, camY, camZ));  //Camera motion
+		if (material->GetTransmittance() > 0.0f) {
+			float ior = material->GetRefrIndex();
+			Vector nOut = cosi > 0.0f ? nHit * -1 : nHit;  //against the ray
+			float ni_over_nt = cosi > 0.0f ? ior : 1.0f / ior;
+			float cosine = cosi > 0.0f ? ior * cosi : -cosi;
+			float dt = V * nOut;
+			float discriminant = 1.0f - ni_over_nt * ni_over_nt * (1.0f - dt * dt);
+
+			// total internal reflection when there is no refracted direction
+			float reflect_prob = discriminant > 0.0f ? schlick(MIN(cosine, 1.0f), ior) : 1.0f;
+
+			if (rand_float() < reflect_prob)
+				direction = V - nOut * (2.0f * dt);
+			else
+				direction = ((V - nOut * dt) * ni_over_nt - nOut * sqrtf(discriminant)).normalize();
+		}
+		else {
+			Color diffuse = material->GetDiffColor() * material->GetDiffuse();
+			Color metal = material->GetSpecColor() * material->GetReflection();
+			float w_diffuse = diffuse.r() + diffuse.g() + diffuse.b();
+			float w_metal = metal.r() + metal.g() + metal.b();
+			Vector nFacing = cosi > 0.0f ? nHit * -1 : nHit;
+			float u, v;
+
+			if (w_diffuse + w_metal <= 0.0f)
+				break;
+
+			float p_diffuse = w_diffuse / (w_diffuse + w_metal);
+			pathSample2D(u, v);
+
+			if (rand_float() < p_diffuse) {
+				// cosine weighted: uniform on the disk, projected up on the hemisphere. The weight is the albedo
+				Vector t = fabs(nFacing.x) > 0.9f ? Vector(0.0f, 1.0f, 0.0f) : Vector(1.0f, 0.0f, 0.0f);
+				Vector b = (nFacing % t).normalize();
+				t = b % nFacing;
+				Vector d = rnd_unit_disk(u, v);
+				float z = sqrtf(MAX(0.0f, 1.0f - d.x * d.x - d.y * d.y));
+
+				direction = t * d.x + b * d.y + nFacing * z;
+				throughput = throughput * diffuse / p_diffuse;
+			}
+			else {
+				direction = V - nFacing * (2.0f * (V * nFacing));
+				if (FUZZY_REFLECTION > 0)
+					direction = (direction + rnd_unit_sphere() * FUZZY_REFLECTION).normalize();
+				if (direction * nFacing <= 0.0f)  //fuzzed below the surface: absorbed
+					break;
+				throughput = throughput * metal / (1.0f - p_diffuse);
+			}
+		}
+
+		// Russian roulette: paths carrying little light stop early, the survivors carry their share
+		if (bounce >= PATH_RR_BOUNCES) {
+			float p_continue = MIN(MAX(throughput.r(), MAX(throughput.g(), throughput.b())), 0.95f);
+			if (rand_float() >= p_continue)
+				break;
+			throughput = throughput / p_continue;
+		}
+
+		// avoid acne effect: start on the side of the surface the new direction leaves through
+		Vector origin = pHit + nHit * (direction * nHit > 0.0f ? EPSILON : -EPSILON);
+		ray = Ray(origin, direction, ray.time);
 	}
+	return color;
+}
 
-	set_rand_seed(time(NULL));
+// Radiance along a primary ray, from the integrator in use
+Color integrate(Ray& ray)
+{
+	if (INTEGRATOR == PATH_INTEGRATOR)
+		return pathTracing(ray);
+	return rayTracing(ray, 1, 1.0);
+}
 
-	
-	// Soft Shadows without antialiasing
-	if (SOFTSHADOWS && !ANTIALIASING) {
-		vector<Light*> new_lights;
 
-		int num_lights = scene->getNumLights();
-		float step = LIGHT_SIDE / NSAMPLES;
-		float start = -LIGHT_SIDE / 2 + step / 2;
-		float end = LIGHT_SIDE / 2;
+// Without antialiasing the primary rays of a tile go through the pixel centers, so the tile loops compute their
+// directions at once (Camera::PrimaryDirections, a vectorized loop) and hand them to traceSample
 
-		for (int l = 0; l < num_lights; l++) {
-			Light* light = scene->getLight(l);
-			Color colorAvg = light->color / (NSAMPLES * NSAMPLES);
+struct TileDirections {
+	int x0, y0, x1, y1;  //pixels [x0, x1) x [y0, y1), row by row
+	float x[TILE_SIZE * TILE_SIZE], y[TILE_SIZE * TILE_SIZE], z[TILE_SIZE * TILE_SIZE];
+};
 
-			for (float i = start; i < end; i = i + step) {
-				for (float k = start; k < end; k = k + step) {
-					Vector pos = Vector(light->position.x + i, light->position.y + k, light->position.z);
+void tileDirections(int x0, int y0, int x1, int y1, TileDirections& tile)
+{
+	float px[TILE_SIZE * TILE_SIZE], py[TILE_SIZE * TILE_SIZE];
+	int count = 0;
 
-					Light* newLight = new Light(pos, colorAvg);
+	tile.x0 = x0; tile.y0 = y0; tile.x1 = x1; tile.y1 = y1;
+	if (ANTIALIASING)
+		return;
 
-					// new scene lights is an area of finite point lights
-					new_lights.push_back(newLight);
-				}
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++, count++) {
+			px[count] = x + 0.5f;
+			py[count] = y + 0.5f;
+		}
+	}
+	scene->GetCamera()->PrimaryDirections(count, px, py, tile.x, tile.y, tile.z);
+}
+
+// Trace the primary ray of the sample_index-th sample of the pixel (x, y); pixel center when there is no antialiasing,
+// from the directions of its tile when they are given. The returned color is not clamped; film_pos gets the image
+// position of the sample
+
+Color traceSample(int x, int y, unsigned int sample_index, Vector& film_pos, const TileDirections* directions = NULL)
+{
+	Vector pixel;  //viewport coordinates
+
+	if (SHADOW_CACHE)
+		shadowCachePixel(x, y);
+
+	if (ANTIALIASING) {
+		Sampler* sampler = thread_sampler();
+		float u, v;
+
+		// sample position inside the pixel
+		sampler->StartPixel(x, y, sample_index);
+		sampler->Get2D(u, v);
+		pixel.x = x + u;
+		pixel.y = y + v;
+		film_pos = pixel;
+
+		// instant of the shutter interval [0, 1] seen by the sample
+		float time = 0.5f;
+		if (scene_motion)
+			sampler->Get2D(time, v);
+
+		if (DOF) {
+			sampler->Get2D(u, v);
+			Vector disk = rnd_unit_disk(u, v);
+			// sample_unit_disk returns point inside unit disk
+			Vector lens_sample = Vector(
+
+				disk.x * scene->GetCamera()->GetAperture(),
+				disk.y * scene->GetCamera()->GetAperture(), 
+				0.0f
+			);
+
+			Ray ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
+			ray.time = time;
+			return integrate(ray);
+		}
+		Ray ray = scene->GetCamera()->PrimaryRay(pixel);
+		ray.time = time;
+		return integrate(ray);
+	}
+
+	// No antialiasing. One primary ray per pixel, through its center (precomputed row and column directions), at the
+	// middle of the shutter interval
+	//YOUR 2 FUNTIONS:
+	film_pos = Vector(x + 0.5f, y + 0.5f, 0.0f);
+
+	// the pixels traced outside of a tile (streamed output) use the camera tables
+	if (directions != NULL) {
+		int i = (y - directions->y0) * (directions->x1 - directions->x0) + (x - directions->x0);
+		Ray ray = Ray(scene->GetCamera()->GetEye(), Vector(directions->x[i], directions->y[i], directions->z[i]), 0.5f);
+		return integrate(ray);
+	}
+	Ray ray = scene->GetCamera()->PrimaryRay(x, y);   //function from camera.h
+	ray.time = 0.5f;
+	return integrate(ray);
+}
+
+Color traceSample(int x, int y, unsigned int sample_index, const TileDirections* directions = NULL)
+{
+	Vector film_pos;
+	return traceSample(x, y, sample_index, film_pos, directions);
+}
+
+
+// Adaptive sampling of the pixel (x, y): samples are added until the standard error of the mean luminance drops 
+// below ADAPTIVE_THRESHOLD (after ADAPTIVE_MIN_SAMPLES) or ADAPTIVE_MAX_SAMPLES is reached. The samples are also
+// splatted to film_tile when there is one
+
+Color adaptiveSample(int x, int y, unsigned int& n_samples, Color& hdr, FilmTile* film_tile)
+{
+	Color color = Color();
+	hdr = Color();
+	double mean = 0.0, m2 = 0.0;  // Welford running mean and sum of squared deviations of the luminance
+	unsigned int n = 0;
+
+	while (n < ADAPTIVE_MAX_SAMPLES) {
+		// the sampler spreads the first samples over the whole pixel
+		Vector film_pos;
+		Color sample = traceSample(x, y, n, film_pos);
+		Color clamped = sample.clamp();
+
+		if (film_tile != NULL)
+			film_tile->AddSample(film_pos.x, film_pos.y, clamped, sample);
+		hdr += sample;
+		sample = clamped;
+		color += sample;
+		n++;
+
+		double lum = 0.2126 * sample.r() + 0.7152 * sample.g() + 0.0722 * sample.b();
+		double delta = lum - mean;
+		mean += delta / n;
+		m2 += delta * (lum - mean);
+
+		if (n >= ADAPTIVE_MIN_SAMPLES && sqrt(m2 / ((n - 1) * n)) <= ADAPTIVE_THRESHOLD)
+			break;
+	}
+	n_samples = n;
+	hdr = hdr / (float)n;
+	return color / (float)n;
+}
+
+
+// Soft Shadows: every point light of the scene becomes a LIGHT_SIDE x LIGHT_SIDE square area light, parallel to the
+// xy plane (once per scene)
+
+void setupSoftShadowLights()
+{
+	if (!SOFTSHADOWS)
+		return;
+
+	Vector edge_u = Vector(LIGHT_SIDE, 0.0f, 0.0f);
+	Vector edge_v = Vector(0.0f, LIGHT_SIDE, 0.0f);
+
+	for (int l = 0; l < scene->getNumLights(); l++) {
+		Light* light = scene->getLight(l);
+		if (!light->IsArea())
+			light->SetRectangle(edge_u, edge_v);
+	}
+}
+
+
+// Color of the pixel (x, y) as the mean of its clamped samples: adaptive sampling, NSAMPLES*NSAMPLES jittered
+// samples or one ray through the pixel center, from the directions of its tile when they are given. hdr gets the mean
+// of the unclamped samples. With a film_tile the antialiasing samples are also splatted to it
+
+Color renderPixel(int x, int y, Color& hdr, unsigned int& n_samples, const TileDirections* directions = NULL,
+	FilmTile* film_tile = NULL)
+{
+	Color color = Color();
+	hdr = Color();
+
+	// multiple primary rays per pixel, only where they are needed
+	if (ANTIALIASING && ADAPTIVE) {
+		return adaptiveSample(x, y, n_samples, hdr, film_tile);
+	}
+
+	// multiple primary rays per pixel
+	else if (ANTIALIASING) {
+
+		for (int n = 0; n < NSAMPLES * NSAMPLES; n++) {
+			Vector film_pos;
+			Color sample = traceSample(x, y, n, film_pos);
+
+			if (film_tile != NULL)
+				film_tile->AddSample(film_pos.x, film_pos.y, sample.clamp(), sample);
+			hdr += sample;
+			color = color + sample.clamp();
+		}
+		hdr = hdr / (NSAMPLES * NSAMPLES);
+		n_samples = NSAMPLES * NSAMPLES;
+		return color / (NSAMPLES * NSAMPLES);
+	}
+
+	// No antialiasing. One primary ray per pixel
+	hdr = traceSample(x, y, 0, directions);
+	n_samples = 1;
+	return hdr.clamp();
+}
+
+// Store the color of a pixel in the output buffers at 3 * index
+void storeColor(unsigned int index, Color& color, Color& hdr)
+{
+	if (!drawModeEnabled && HDR_OUTPUT) {
+		hdr_Data[3 * index] = hdr.r();
+		hdr_Data[3 * index + 1] = hdr.g();
+		hdr_Data[3 * index + 2] = hdr.b();
+	}
+
+	img_Data[3 * index] = u8fromfloat((float)color.r());
+	img_Data[3 * index + 1] = u8fromfloat((float)color.g());
+	img_Data[3 * index + 2] = u8fromfloat((float)color.b());
+}
+
+// Store a pixel and its number of samples in the output buffers at 3 * index
+void storePixel(unsigned int index, Color& color, Color& hdr, unsigned int n_samples)
+{
+	if (ANTIALIASING && ADAPTIVE)
+		samples_Data[3 * index] = samples_Data[3 * index + 1] = samples_Data[3 * index + 2] = (uint8_t)(255 * n_samples / ADAPTIVE_MAX_SAMPLES);
+
+	storeColor(index, color, hdr);
+}
+
+
+// Tiles of the image, row by row from the bottom
+
+int numTiles()
+{
+	return ((RES_X + TILE_SIZE - 1) / TILE_SIZE) * ((RES_Y + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+// Pixels [x0, x1) x [y0, y1) of the tile
+void tileBounds(int tile, int& x0, int& y0, int& x1, int& y1)
+{
+	int tiles_x = (RES_X + TILE_SIZE - 1) / TILE_SIZE;
+	x0 = (tile % tiles_x) * TILE_SIZE;
+	y0 = (tile / tiles_x) * TILE_SIZE;
+	x1 = MIN(x0 + TILE_SIZE, RES_X);
+	y1 = MIN(y0 + TILE_SIZE, RES_Y);
+}
+
+// Position (x, y) of the i-th pixel of the tile [x0, x1) x [y0, y1) in pixel_order. Along the Z-order (Morton) curve
+// consecutive pixels stay close in both directions, so consecutive rays go through the same BVH nodes and primitives
+// and find them in the cache. Returns false for the positions that fall outside a border tile
+
+bool tilePixel(unsigned int i, int x0, int y0, int x1, int y1, int& x, int& y)
+{
+	if (pixel_order == MORTON_ORDER) {
+		x = x0 + (int)compact_bits(i);
+		y = y0 + (int)compact_bits(i >> 1);
+	}
+	else {
+		x = x0 + (int)(i % TILE_SIZE);
+		y = y0 + (int)(i / TILE_SIZE);
+	}
+	return x < x1 && y < y1;
+}
+
+// Trace the tile of a pass of the OpenGL drawing mode and publish it to frame_Data. The tile is dropped when the
+// pass is cancelled (the camera moved)
+
+void renderTile(int tile, CancelToken& token)
+{
+	uint8_t tile_Data[4 * TILE_SIZE * TILE_SIZE];
+	TileDirections directions;
+	int x0, y0, x1, y1;
+
+	if (token.IsCancelled())
+		return;
+
+	tileBounds(tile, x0, y0, x1, y1);
+	tileDirections(x0, y0, x1, y1, directions);
+
+	for (int i = 0; i < TILE_SIZE * TILE_SIZE; i++) {
+		int x, y;
+		if (!tilePixel(i, x0, y0, x1, y1, x, y))
+			continue;
+
+		Color color;
+
+		if (PROGRESSIVE) {
+			// one sample per pass: pass n traces the n-th sample of the pixel
+			int index = 3 * (y * RES_X + x);
+
+			Color sample = traceSample(x, y, accum_Passes, &directions).clamp();
+
+			accum_Data[index] += sample.r();
+			accum_Data[index + 1] += sample.g();
+			accum_Data[index + 2] += sample.b();
+			color = Color(accum_Data[index], accum_Data[index + 1], accum_Data[index + 2]) / (float)(accum_Passes + 1);
+		}
+		else {
+			Color hdr;
+			unsigned int n_samples;
+			color = renderPixel(x, y, hdr, n_samples, &directions);
+		}
+
+		uint8_t* pixel = tile_Data + 4 * ((y - y0) * TILE_SIZE + (x - x0));
+		pixel[0] = u8fromfloat((float)color.r());
+		pixel[1] = u8fromfloat((float)color.g());
+		pixel[2] = u8fromfloat((float)color.b());
+		pixel[3] = 255;
+	}
+
+	std::lock_guard<std::mutex> lock(frame_mutex);
+	if (token.IsCancelled())
+		return;  // never show an old camera over the tiles of the new one
+
+	for (int y = y0; y < y1; y++)
+		memcpy(frame_Data + 4 * ((size_t)y * RES_X + x0), tile_Data + 4 * (y - y0) * TILE_SIZE, 4 * (x1 - x0));
+	frame_Dirty = true;
+}
+
+// Render thread of the OpenGL drawing mode: traces passes until the image is converged, then sleeps until the camera moves
+
+void renderLoop()
+{
+	unsigned int generation = 0;
+	unsigned int passes = PROGRESSIVE ? PROGRESSIVE_PASSES : 1;
+	int n_tiles = numTiles();
+
+	while (true) {
+		CancelToken token;
+		{
+			std::unique_lock<std::mutex> lock(render_mutex);
+			render_cv.wait(lock, [&] { return render_Exit || render_Generation != generation || accum_Passes < passes; });
+			if (render_Exit)
+				return;
+
+			// the camera moved: restart the accumulation. The workers are idle, so the camera can be changed
+			if (render_Generation != generation) {
+				generation = render_Generation;
+				scene->GetCamera()->SetEye(render_Eye);
+				accum_Passes = 0;
 			}
+			render_Token = &token;
 		}
-		scene->setLights(new_lights);
+
+		if (accum_Passes == 0)
+			memset(accum_Data, 0, 3 * RES_X * RES_Y * sizeof(float));
+
+		render_pool->Run(n_tiles, [&token](int tile) { renderTile(tile, token); });
+
+		std::lock_guard<std::mutex> lock(render_mutex);
+		render_Token = NULL;
+		if (!token.IsCancelled())
+			accum_Passes++;
 	}
-	
+}
+
+void startRenderThread()
+{
+	render_Eye = scene->GetCamera()->GetEye();
+	render_Generation = 1;
+
+	render_thread = std::thread(renderLoop);
+}
+
+void stopRenderThread()
+{
+	if (!render_thread.joinable())
+		return;
 
-	for (int y = 0; y < RES_Y; y++)
 	{
-		for (int x = 0; x < RES_X; x++)
-		{
-			Color color = Color();
-			Vector pixel;  //viewport coordinates
-			Ray ray = scene->GetCamera()->PrimaryRay(pixel); // Is like having a null ray
-			
-			// multiple primary rays per pixel
-			if (ANTIALIASING) {
-
-				// Jittering method
-				for (int pi = 0; pi < NSAMPLES; pi++) {
-					for (int pj = 0; pj < NSAMPLES; pj++) {
-						pixel.x = x + ((pi + rand_float()) / NSAMPLES);
-						pixel.y = y + ((pj + rand_float()) / NSAMPLES);
-
-						if (DOF) {
-							Vector disk = rnd_unit_disk();
-							// sample_unit_disk returns point inside unit disk
-							Vector lens_sample = Vector(
-
-								disk.x * scene->GetCamera()->GetAperture(),
-								disk.y * scene->GetCamera()->GetAperture(), 
-								0.0f
-							);
-
-							ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
-						}
-						else {
-							ray = scene->GetCamera()->PrimaryRay(pixel);
-						}
-
-						color = color + rayTracing(ray, 1, 1.0, pi, pj).clamp();
-					}
-				}
-				color = color / (NSAMPLES * NSAMPLES);
+		std::lock_guard<std::mutex> lock(render_mutex);
+		render_Exit = true;
+		if (render_Token) render_Token->Cancel();  // drop the pass in flight
+	}
+	render_cv.notify_one();
+	render_thread.join();
+}
+
+// GLUT display and idle function of the OpenGL drawing mode: posts camera changes to the render thread and presents
+// the tiles it finished since the last call. No ray is traced on this thread, so the window never freezes
+
+void displayFrame()
+{
+	Vector eye = Vector(camX, camY, camZ);  //Camera motion
+	{
+		std::lock_guard<std::mutex> lock(render_mutex);
+		if (eye.x != render_Eye.x || eye.y != render_Eye.y || eye.z != render_Eye.z) {
+			render_Eye = eye;
+			render_Generation++;
+			if (render_Token) render_Token->Cancel();
+			render_cv.notify_one();
+		}
+	}
+
+	waitDisplayBuffer();
+	{
+		std::lock_guard<std::mutex> lock(frame_mutex);
+		if (frame_Dirty) {
+			memcpy(display_Data, frame_Data, 4 * (size_t)RES_X * RES_Y);
+			frame_Dirty = false;
+			display_Dirty = true;
+		}
+	}
+
+	drawFrame();
+	glutSwapBuffers();
+}
+
+
+// Time-budgeted rendering of the image file mode: passes of one sample per pixel until every pixel has all its samples
+// or the token is cancelled. Each tile counts its own passes, so the tiles finished in the interrupted pass keep their
+// extra sample. Returns the number of complete passes
+
+unsigned int renderBudgeted(CancelToken& token, unsigned long long& total_samples)
+{
+	int n_tiles = numTiles();
+	unsigned int max_passes = !ANTIALIASING ? 1 : ADAPTIVE ? ADAPTIVE_MAX_SAMPLES : NSAMPLES * NSAMPLES;
+	unsigned int pass = 0;
+
+	vector<unsigned int> tile_passes(n_tiles, 0);
+	vector<float> accum(3 * (size_t)RES_X * RES_Y, 0.0f);      //clamped samples
+	vector<float> accum_hdr(3 * (size_t)RES_X * RES_Y, 0.0f);  //unclamped samples
+
+	for (; pass < max_passes && !token.IsCancelled(); pass++) {
+		render_pool->Run(n_tiles, [&](int tile) {
+			TileDirections directions;
+			int x0, y0, x1, y1;
+
+			if (token.IsCancelled())
+				return;
+
+			tileBounds(tile, x0, y0, x1, y1);
+			tileDirections(x0, y0, x1, y1, directions);
+			for (int i = 0; i < TILE_SIZE * TILE_SIZE; i++) {
+				int x, y;
+				if (!tilePixel(i, x0, y0, x1, y1, x, y))
+					continue;
+
+				size_t index = 3 * ((size_t)y * RES_X + x);
+				Color sample = traceSample(x, y, pass, &directions);
+				Color clamped = sample.clamp();
+
+				accum[index] += clamped.r();
+				accum[index + 1] += clamped.g();
+				accum[index + 2] += clamped.b();
+				accum_hdr[index] += sample.r();
+				accum_hdr[index + 1] += sample.g();
+				accum_hdr[index + 2] += sample.b();
 			}
+			tile_passes[tile]++;
+		});
+	}
 
-			// No antialiasing. One primary ray per pixel
-			else {
-				pixel.x = x + 0.5f;
-				pixel.y = y + 0.5f;
+	// resolve: mean of the samples each pixel got (the tiles never reached stay black)
+	for (int tile = 0; tile < n_tiles; tile++) {
+		int x0, y0, x1, y1;
+		unsigned int n_samples = tile_passes[tile];
+		float weight = n_samples > 0 ? 1.0f / n_samples : 0.0f;
 
-				//YOUR 2 FUNTIONS:
-				ray = scene->GetCamera()->PrimaryRay(pixel);   //function from camera.h
-				color = rayTracing(ray, 1, 1.0, 0, 0).clamp();	   // last two arguments = no offset
+		tileBounds(tile, x0, y0, x1, y1);
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				size_t index = 3 * ((size_t)y * RES_X + x);
+				Color color = Color(accum[index], accum[index + 1], accum[index + 2]) * weight;
+				Color hdr = Color(accum_hdr[index], accum_hdr[index + 1], accum_hdr[index + 2]) * weight;
+
+				storePixel(y * RES_X + x, color, hdr, n_samples);
 			}
+		}
+		total_samples += (unsigned long long)n_samples * (x1 - x0) * (y1 - y0);
+	}
 
-			img_Data[counter++] = u8fromfloat((float)color.r());
-			img_Data[counter++] = u8fromfloat((float)color.g());
-			img_Data[counter++] = u8fromfloat((float)color.b());
+	unsigned int complete_passes = *std::min_element(tile_passes.begin(), tile_passes.end());
+	if (complete_passes < max_passes)
+		printf("Time budget of %d ms reached after %u of %u passes\n", RENDER_BUDGET_MS, complete_passes, max_passes);
+	return complete_passes;
+}
 
-			if (drawModeEnabled) {
-				vertices[index_pos++] = (float)x;
-				vertices[index_pos++] = (float)y;
-				colors[index_col++] = (float)color.r();
+// Queue the image buffers for the writer as name.png (and name.pfm)
+void submitImage(const string& name, unsigned long long total_samples)
+{
+	// the writer copies the buffers: the next frame can be rendered while these are encoded
+	image_writer->Submit((name + ".png").c_str(), RES_X, RES_Y, img_Data);
+	if (HDR_OUTPUT)
+		image_writer->SubmitHDR((name + ".pfm").c_str(), RES_X, RES_Y, hdr_Data);
+
+	if (ANTIALIASING && ADAPTIVE) {
+		printf("Adaptive sampling: %.2f samples per pixel on average\n", (double)total_samples / (RES_X * RES_Y));
+		if (ADAPTIVE_DEBUG_IMAGE)
+			image_writer->Submit("RT_Samples.png", RES_X, RES_Y, samples_Data);
+	}
+}
 
-				colors[index_col++] = (float)color.g();
+// The filtered colors of the film replace the means of the samples, once every tile is merged
 
-				colors[index_col++] = (float)color.b();
+void resolveFilm()
+{
+	render_pool->Run(numTiles(), [&](int tile) {
+		int x0, y0, x1, y1;
+
+		tileBounds(tile, x0, y0, x1, y1);
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				Color color, hdr;
+				film->Resolve(x, y, color, hdr);
+				storeColor(y * RES_X + x, color, hdr);
 			}
 		}
-	}
+	});
+}
+
+// Render function by primary ray casting from the eye towards the scene's objects (image file mode). The tiles are
+// traced in parallel; the token stops the render at tile granularity. With the film, each tile splats its samples
+// into a tile of its own and merges it into the film, which is resolved into the image once every tile is done
+
+void renderScene(const char* output_name = "RT_Output")
+{
+	string name = output_name;
+	CancelToken token;
+	std::atomic<unsigned long long> total_samples(0);
+
+	if (RENDER_BUDGET_MS > 0) {
+		unsigned long long samples = 0;
 
-	if (drawModeEnabled) {
-		drawPoints();
-		glutSwapBuffers();
+		token.SetBudget(RENDER_BUDGET_MS);
+		renderBudgeted(token, samples);
+		total_samples = samples;
 	}
 	else {
-		printf("Terminou o desenho!\n");
-		if (saveImgFile("RT_Output.png") != IL_NO_ERROR) {
-			printf("Error saving Image file\n");
-			exit(0);
+		if (film != NULL)
+			film->Clear();
+
+		render_pool->Run(numTiles(), [&](int tile) {
+			TileDirections directions;
+			int x0, y0, x1, y1;
+			unsigned long long tile_samples = 0;
+
+			if (token.IsCancelled())
+				return;
+
+			tileBounds(tile, x0, y0, x1, y1);
+			tileDirections(x0, y0, x1, y1, directions);
+			FilmTile film_tile = film != NULL ? film->GetTile(x0, y0, x1, y1) : FilmTile();
+
+			for (int i = 0; i < TILE_SIZE * TILE_SIZE; i++) {
+				int x, y;
+				if (!tilePixel(i, x0, y0, x1, y1, x, y))
+					continue;
+
+				Color hdr;
+				unsigned int n_samples;
+
+				Color color = renderPixel(x, y, hdr, n_samples, &directions, film != NULL ? &film_tile : NULL);
+				tile_samples += n_samples;
+				storePixel(y * RES_X + x, color, hdr, n_samples);
+			}
+			if (film != NULL)
+				film->MergeTile(film_tile);
+			total_samples += tile_samples;
+		});
+
+		if (film != NULL)
+			resolveFilm();
+	}
+
+	printf("Terminou o desenho!\n");
+	if (SHADOW_CACHE && shadow_cache_lookups > 0)
+		printf("Shadow cache: %.1f%% of %llu point light shadow rays reused\n", 100.0 * shadow_cache_hits / shadow_cache_lookups,
+			(unsigned long long)shadow_cache_lookups);
+	if (irradiance_cache != NULL) {
+		printf("Irradiance cache: %.1f%% of the lookups interpolated, %d records\n", 100.0 * irradiance_cache->GetHitRate(),
+			irradiance_cache->getNumRecords());
+		irradiance_cache->ResetStats();
+	}
+	submitImage(name, total_samples);
+}
+
+// Irradiance cache of the current scene: its octree spans the objects; the records on planes outside of it stay in its root
+void createIrradianceCache()
+{
+	irradiance_cache = NULL;
+	if (scene->getNumObjects() == 0)
+		return;  //nothing to bound, and no hit to cache
+
+	AABB bounds = scene->getObject(0)->GetBoundingBox();
+	for (int o = 1; o < scene->getNumObjects(); o++)
+		bounds.extend(scene->getObject(o)->GetBoundingBox());
+
+	float scene_size = (bounds.max - bounds.min).length();
+	irradiance_cache = new IrradianceCache(IRRADIANCE_CACHE_ERROR, IRRADIANCE_MIN_SPACING * scene_size,
+		IRRADIANCE_MAX_SPACING * scene_size, bounds);
+}
+
+// Animation (image file mode): every sphere bounces along the camera up vector, out of phase with the others, and the
+// frames are rendered one after the other. The BVH follows the spheres by refitting; the time of every update is
+// reported so it can be compared with the rebuilds the SAH heuristic triggers
+
+void renderAnimation()
+{
+	vector<Sphere*> spheres;
+	vector<Vector> rest;  //centers in the scene file
+	Vector up = scene->GetCamera()->GetUp();
+	char name[32];
+	int rebuilds = 0;
+
+	up.normalize();
+	for (int o = 0; o < scene->getNumObjects(); o++) {
+		Sphere* sphere = dynamic_cast<Sphere*>(scene->getObject(o));
+		if (sphere == NULL) continue;
+		spheres.push_back(sphere);
+		rest.push_back(sphere->GetCenter());
+	}
+	printf("Animation: %d frames, %d spheres\n", ANIMATION_FRAMES, (int)spheres.size());
+
+	for (int frame = 0; frame < ANIMATION_FRAMES; frame++) {
+		float time = (float)frame / MAX(ANIMATION_FRAMES, 1);  //the loop is empty with no frames
+
+		for (unsigned int i = 0; i < spheres.size(); i++) {
+			float phase = i * 0.618034f;  //golden ratio: neighbours never bounce together
+			float height = MIN((float)ANIMATION_HEIGHT, spheres[i]->GetRadius());
+			Vector center = rest[i] + up * (height * fabs(sinf(PI * (time * 2.0f + phase))));
+			spheres[i]->SetCenter(center);
 		}
-		printf("Image file created\n");
+
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		bool rebuilt = false;
+		if (Accel_Struct == BVH_ACC)
+			rebuilt = bvh_ptr->Update(ANIMATION_REBUILD_RATIO);
+		else if (Accel_Struct == GRID_ACC) {  //no refit: the grid is built again
+			vector<Object*> objs;
+			for (int o = 0; o < scene->getNumObjects(); o++)
+				objs.push_back(scene->getObject(o));
+			delete grid_ptr;
+			grid_ptr = new Grid();
+			grid_ptr->Build(objs);
+			rebuilt = true;
+		}
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+		double passedTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+		rebuilds += rebuilt ? 1 : 0;
+
+		printf("\nFrame %d: %s in %.2f ms", frame, rebuilt ? "rebuilt" : "refitted", passedTime);
+		if (Accel_Struct == BVH_ACC)
+			printf(", SAH cost %.2f", bvh_ptr->SAHCost());
+		printf("\n");
+
+		// the cached visibility and irradiance belong to the previous positions
+		shadowCacheReset();
+		if (irradiance_cache != NULL) {
+			delete irradiance_cache;
+			createIrradianceCache();
+		}
+
+		sprintf(name, "RT_Frame_%03d", frame);
+		renderScene(name);
+	}
+	printf("Animation: %d rebuilds in %d frames\n", rebuilds, ANIMATION_FRAMES);
+}
+
+
+// Pixel order benchmark (image file mode): traces the primary rays of every tile through the acceleration structure,
+// row by row and along the Morton curve, and reports the throughput of each order (best of BENCHMARK_RUNS). Only the
+// closest hit is searched, so the timing measures the traversal coherence and not the shading. The cache misses behind
+// the difference are left to a hardware profiler (VTune, perf stat -e cache-misses)
+
+void benchmarkPixelOrder()
+{
+	const char* names[2] = { "row-major", "Morton" };
+	PixelOrder orders[2] = { ROW_ORDER, MORTON_ORDER };
+	int n_tiles = numTiles();
+	double rays = (double)RES_X * RES_Y;
+
+	printf("Pixel order benchmark: %dx%d primary rays, %u threads, %d runs\n", RES_X, RES_Y, render_pool->GetNumThreads(), BENCHMARK_RUNS);
+
+	for (int o = 0; o < 2; o++) {
+		double best_ms = DBL_MAX;
+		std::atomic<unsigned int> hits(0);
+
+		pixel_order = orders[o];
+		for (int run = 0; run < BENCHMARK_RUNS; run++) {
+			hits = 0;
+			auto timeStart = std::chrono::high_resolution_clock::now();
+
+			render_pool->Run(n_tiles, [&](int tile) {
+				float px[TILE_SIZE * TILE_SIZE], py[TILE_SIZE * TILE_SIZE];
+				float dir_x[TILE_SIZE * TILE_SIZE], dir_y[TILE_SIZE * TILE_SIZE], dir_z[TILE_SIZE * TILE_SIZE];
+				int x0, y0, x1, y1;
+				int count = 0;
+				unsigned int tile_hits = 0;
+
+				// the primary rays of the whole tile are generated at once
+				tileBounds(tile, x0, y0, x1, y1);
+				for (int i = 0; i < TILE_SIZE * TILE_SIZE; i++) {
+					int x, y;
+					if (!tilePixel(i, x0, y0, x1, y1, x, y))
+						continue;
+
+					px[count] = x + 0.5f;
+					py[count++] = y + 0.5f;
+				}
+				scene->GetCamera()->PrimaryDirections(count, px, py, dir_x, dir_y, dir_z);
+
+				for (int i = 0; i < count; i++) {
+					Ray ray = Ray(scene->GetCamera()->GetEye(), Vector(dir_x[i], dir_y[i], dir_z[i]));
+					HitRecord hit;
+
+					if (Accel_Struct == GRID_ACC ? grid_ptr->Traverse(ray, hit) : bvh_ptr->Traverse(ray, hit))
+						tile_hits++;
+				}
+				hits += tile_hits;
+			});
+
+			auto timeEnd = std::chrono::high_resolution_clock::now();
+			double passedTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+			best_ms = MIN(best_ms, passedTime);
+		}
+		printf("  %-10s %8.2f ms  %7.2f Mrays/s  (%u hits)\n", names[o], best_ms, rays / (best_ms * 1000.0), (unsigned int)hits);
 	}
+	pixel_order = PIXEL_ORDER;
+}
+
+
+// Streaming output (file mode): the image is rendered in bands of STREAM_BAND_ROWS rows from the top down and each band
+// is appended to the output files as soon as it is finished. The pixel buffers only hold one band
+
+void renderStreamed()
+{
+	PNGStreamWriter png, samples_png;
+	PFMStreamWriter pfm;
+	bool debug_samples = ANTIALIASING && ADAPTIVE && ADAPTIVE_DEBUG_IMAGE;
+	unsigned long long total_samples = 0;
+
+	set_rand_seed(time(NULL));
+	if (!png.Open("RT_Output.png", RES_X, RES_Y) || (HDR_OUTPUT && !pfm.Open("RT_Output.pfm", RES_X, RES_Y)) ||
+		(debug_samples && !samples_png.Open("RT_Samples.png", RES_X, RES_Y))) {
+		printf("Error opening the output files\n");
+		return;
+	}
+
+	for (int band_end = RES_Y; band_end > 0; band_end -= STREAM_BAND_ROWS) {
+		int band_start = MAX(band_end - STREAM_BAND_ROWS, 0);
+		unsigned int counter = 0;
+
+		for (int y = band_start; y < band_end; y++) {
+			for (int x = 0; x < RES_X; x++) {
+				Color hdr;
+				unsigned int n_samples;
+
+				Color color = renderPixel(x, y, hdr, n_samples);
+				total_samples += n_samples;
+				storePixel(counter++, color, hdr, n_samples);
+			}
+		}
+
+		// PNG scanlines go from the top of the image down, the PFM band is placed at its own offset
+		for (int y = band_end - 1; y >= band_start; y--) {
+			png.WriteRow(img_Data + 3 * RES_X * (y - band_start));
+			if (debug_samples) samples_png.WriteRow(samples_Data + 3 * RES_X * (y - band_start));
+		}
+		if (HDR_OUTPUT) pfm.WriteRows(band_start, band_end - band_start, hdr_Data);
+	}
+
+	printf("Terminou o desenho!\n");
+	if (!png.Close() || !pfm.Close() || !samples_png.Close())
+		printf("Error saving Image file\n");
+	else
+		printf("Image file created\n");
+
+	if (ANTIALIASING && ADAPTIVE)
+		printf("Adaptive sampling: %.2f samples per pixel on average\n", (double)total_samples / ((double)RES_X * RES_Y));
 }
 
 
@@ -898,13 +2024,13 @@ void setupCallbacks()
 {
 	glutKeyboardFunc(processKeys);
 	glutCloseFunc(cleanup);
-	glutDisplayFunc(renderScene);
+	glutDisplayFunc(displayFrame);
 	glutReshapeFunc(reshape);
 	glutMouseFunc(processMouseButtons);
 	glutMotionFunc(processMouseMotion);
 	glutMouseWheelFunc(mouseWheel);
 
-	glutIdleFunc(renderScene);
+	glutIdleFunc(displayFrame);
 	glutTimerFunc(0, timer, 0);
 }
 void init(int argc, char* argv[])
@@ -928,15 +2054,63 @@ void init(int argc, char* argv[])
 }
 
 
-void init_scene(void)
+// Loader benchmark: the scene file parsed BENCHMARK_RUNS times by Scene::load_p3f_stream (ifstream, one thread) and
+// by Scene::load_p3f (memory mapped, meshes in parallel). The scenes are thrown away
+
+void benchmarkLoader(const char* scene_name)
+{
+	const char* names[2] = { "ifstream", "memory mapped" };
+	double best_ms[2] = { DBL_MAX, DBL_MAX };
+
+	printf("Loader benchmark: %s, %u threads, %d runs\n", scene_name, render_pool->GetNumThreads(), BENCHMARK_RUNS);
+
+	for (int loader = 0; loader < 2; loader++) {
+		int n_objects = 0;
+
+		for (int run = 0; run < BENCHMARK_RUNS; run++) {
+			Scene* loaded = new Scene();
+
+			auto timeStart = std::chrono::high_resolution_clock::now();
+			if (loader == 0) loaded->load_p3f_stream(scene_name);
+			else loaded->load_p3f(scene_name, render_pool);
+			auto timeEnd = std::chrono::high_resolution_clock::now();
+
+			double passedTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+			best_ms[loader] = MIN(best_ms[loader], passedTime);
+			n_objects = loaded->getNumObjects();
+			delete loaded;
+		}
+		printf("  %-14s %8.1f ms, %d objects\n", names[loader], best_ms[loader], n_objects);
+	}
+	printf("  speedup %.2fx\n", best_ms[0] / best_ms[1]);
+}
+
+// Load the scene, asking for its name unless scene_file is given (false when that file cannot be opened), and build
+// everything the render needs
+
+bool init_scene(const char* scene_file = NULL)
 {
 	char scenes_dir[70] = "P3D_Scenes/";
 	char input_user[50];
 	char scene_name[70];
 
+	if (scene_file != NULL) {
+		ifstream file(string(scenes_dir) + scene_file, ios::in);
+		if (strlen(scene_file) >= sizeof(input_user) || file.fail()) {
+			printf("\nError opening P3F file.\n");
+			return false;
+		}
+	}
+
 	scene = new Scene();
 
-	if (P3F_scene) {  //Loading a P3F scene
+	if (P3F_scene && scene_file != NULL) {
+		strcpy_s(scene_name, sizeof(scene_name), scenes_dir);
+		strcat_s(scene_name, sizeof(scene_name), scene_file);
+		scene->load_p3f(scene_name, render_pool);
+		printf("Scene loaded.\n\n");
+	}
+	else if (P3F_scene) {  //Loading a P3F scene
 
 		while (true) {
 			cout << "Input the Scene Name: ";
@@ -952,7 +2126,9 @@ void init_scene(void)
 				break;
 		}
 
-		scene->load_p3f(scene_name);
+		if (BENCHMARK_LOADER)
+			benchmarkLoader(scene_name);
+		scene->load_p3f(scene_name, render_pool);
 		printf("Scene loaded.\n\n");
 	}
 	else {
@@ -961,14 +2137,41 @@ void init_scene(void)
 	}
 
 
+	scene_motion = false;
+	for (int i = 0; i < scene->getNumObjects(); i++)
+		scene_motion = scene_motion || scene->getObject(i)->IsMoving();
+	if (scene_motion)
+		printf("Motion blur: shutter interval sampled by every primary ray.\n");
+
+	// every light is built before the light sampler
+	setupSoftShadowLights();
+	shadowCacheReset();
+	light_sampler = new LightSampler();
+	light_sampler->Build(scene);
+	if (LIGHT_SAMPLING && scene->getNumLights() > LIGHT_SAMPLING_MIN)
+		printf("Many lights: %d lights, %d shadow rays per hit\n", scene->getNumLights(), LIGHT_SAMPLES);
+
 	RES_X = scene->GetCamera()->GetResX();
 	RES_Y = scene->GetCamera()->GetResY();
 	printf("\nResolutionX = %d  ResolutionY= %d.\n", RES_X, RES_Y);
 
-	// Pixel buffer to be used in the Save Image function
-	img_Data = (uint8_t*)malloc(3 * RES_X*RES_Y * sizeof(uint8_t));
+	// Pixel buffers to be used in the Save Image function: just one band of rows when the output is streamed
+	size_t buffer_pixels = (size_t)RES_X * (!drawModeEnabled && STREAM_OUTPUT ? MIN(STREAM_BAND_ROWS, RES_Y) : RES_Y);
+
+	img_Data = (uint8_t*)malloc(3 * buffer_pixels * sizeof(uint8_t));
 	if (img_Data == NULL) exit(1);
 
+	samples_Data = (uint8_t*)malloc(3 * buffer_pixels * sizeof(uint8_t));
+	if (samples_Data == NULL) exit(1);
+
+	if (!drawModeEnabled && HDR_OUTPUT) {
+		hdr_Data = (float*)malloc(3 * buffer_pixels * sizeof(float));
+		if (hdr_Data == NULL) exit(1);
+	}
+
+	if (!drawModeEnabled && !STREAM_OUTPUT && RENDER_BUDGET_MS == 0 && ANTIALIASING && PIXEL_FILTER != BOX_FILTER)
+		film = new Film(RES_X, RES_Y, PIXEL_FILTER);
+
 	//Accel_Struct = scene->GetAccelStruct();   //Type of acceleration data structure
 
 	if (Accel_Struct == GRID_ACC) {
@@ -986,6 +2189,7 @@ void init_scene(void)
 		vector<Object*> objs;
 		int num_objects = scene->getNumObjects();
 		bvh_ptr = new BVH();
+		bvh_ptr->SetSpherePackets(BVH_SPHERE_PACKETS);
 
 		for (int o = 0; o < num_objects; o++) {
 			objs.push_back(scene->getObject(o));
@@ -996,12 +2200,113 @@ void init_scene(void)
 	else
 		printf("No acceleration data structure.\n\n");
 
+	set_sampler(SAMPLER, ADAPTIVE ? ADAPTIVE_MAX_SAMPLES : NSAMPLES * NSAMPLES);
+
 	unsigned int spp = scene->GetSamplesPerPixel();
 	if (spp == 0)
 		printf("Whitted Ray-Tracing\n");
 	else
 		printf("Distribution Ray-Tracing\n");
 
+	if (INDIRECT_DIFFUSE && IRRADIANCE_CACHE)
+		createIrradianceCache();
+	return true;
+}
+
+
+// Render farm coordinator: loads the scene once, for its resolution, its tiles and its film, and writes the image the
+// workers render. Every tile comes back as 7 floats per pixel: the clamped color, the unclamped one and the number of
+// samples; with the film, also the sums of its film tile, merged into the film as renderScene does
+
+void renderFarmCoordinator(const char* scene_file, unsigned short port)
+{
+	FarmCoordinator coordinator;
+	std::atomic<unsigned long long> total_samples(0);
+
+	if (!init_scene(scene_file))
+		return;
+
+	unsigned int tile_floats = 7 * TILE_SIZE * TILE_SIZE;
+	if (film != NULL) {
+		unsigned int side = TILE_SIZE + 2 * film->GetMargin();
+		tile_floats += 7 * side * side;
+	}
+
+	auto timeStart = std::chrono::high_resolution_clock::now();
+	bool listening = coordinator.Run(port, scene_file, numTiles(), tile_floats, FARM_TIMEOUT, [&](const FarmTileResult& result) {
+		int x0, y0, x1, y1;
+
+		tileBounds(result.tile, x0, y0, x1, y1);
+		FilmTile film_tile = film != NULL ? film->GetTile(x0, y0, x1, y1) : FilmTile();
+		if (result.pixels.size() != 7 * (size_t)(x1 - x0) * (y1 - y0) || !film_tile.SetSums(result.film)) {
+			printf("Tile %d: wrong size, left black\n", result.tile);
+			return;
+		}
+
+		const float* p = &result.pixels[0];
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++, p += 7) {
+				Color color = Color(p[0], p[1], p[2]);
+				Color hdr = Color(p[3], p[4], p[5]);
+				storePixel(y * RES_X + x, color, hdr, (unsigned int)p[6]);
+			}
+		}
+		if (film != NULL)
+			film->MergeTile(film_tile);
+		total_samples += result.n_samples;
+	});
+	if (listening && film != NULL)
+		resolveFilm();
+	auto timeEnd = std::chrono::high_resolution_clock::now();
+
+	if (!listening) {
+		printf("Cannot listen on port %u\n", port);
+		return;
+	}
+	coordinator.PrintStats(std::chrono::duration<double, std::milli>(timeEnd - timeStart).count());
+	submitImage("RT_Output", total_samples);
+}
+
+// Render farm worker: renders the batches of tiles the coordinator sends, one tile per thread, splatting the samples
+// into a film tile when the pixel filter is not the box
+
+void renderFarmWorker(const char* host, unsigned short port)
+{
+	RunFarmWorker(host, port, render_pool->GetNumThreads(),
+		[](const string& scene_file) { return init_scene(scene_file.c_str()); },
+		[](const vector<int>& tiles, vector<FarmTileResult>& results) {
+			results.resize(tiles.size());
+
+			render_pool->Run(tiles.size(), [&](int t) {
+				FarmTileResult& result = results[t];
+				TileDirections directions;
+				int x0, y0, x1, y1;
+
+				tileBounds(tiles[t], x0, y0, x1, y1);
+				tileDirections(x0, y0, x1, y1, directions);
+				FilmTile film_tile = film != NULL ? film->GetTile(x0, y0, x1, y1) : FilmTile();
+				result.tile = tiles[t];
+				result.n_samples = 0;
+				result.pixels.resize(7 * (size_t)(x1 - x0) * (y1 - y0));
+
+				for (int i = 0; i < TILE_SIZE * TILE_SIZE; i++) {
+					int x, y;
+					if (!tilePixel(i, x0, y0, x1, y1, x, y))
+						continue;
+
+					Color hdr;
+					unsigned int n_samples;
+					Color color = renderPixel(x, y, hdr, n_samples, &directions, film != NULL ? &film_tile : NULL);
+					float* p = &result.pixels[7 * ((size_t)(y - y0) * (x1 - x0) + (x - x0))];
+
+					p[0] = color.r(); p[1] = color.g(); p[2] = color.b();
+					p[3] = hdr.r(); p[4] = hdr.g(); p[5] = hdr.b();
+					p[6] = (float)n_samples;
+					result.n_samples += n_samples;
+				}
+				result.film = film_tile.GetSums();
+			});
+		});
 }
 
 int main(int argc, char* argv[])
@@ -1014,44 +2319,86 @@ int main(int argc, char* argv[])
 	}
 	ilInit();
 
+	// render farm processes: image file mode, no questions
+	if (argc > 1 && (strcmp(argv[1], "-coordinator") == 0 || strcmp(argv[1], "-worker") == 0)) {
+		drawModeEnabled = false;
+		image_writer = new ImageWriter(WRITER_QUEUE);
+		render_pool = new ThreadPool(RENDER_THREADS);
+
+		if (strcmp(argv[1], "-worker") == 0)
+			renderFarmWorker(argc > 2 ? argv[2] : "127.0.0.1", argc > 3 ? (unsigned short)atoi(argv[3]) : FARM_PORT);
+		else if (argc > 2)
+			renderFarmCoordinator(argv[2], argc > 3 ? (unsigned short)atoi(argv[3]) : FARM_PORT);
+		else
+			printf("Usage: MyRayTracer -coordinator <scene> [port]\n");
+
+		delete image_writer;  //waits for the image files
+		delete render_pool;
+		return 0;
+	}
+
 	int 
 		ch;
 	if (!drawModeEnabled) {
 
+		image_writer = new ImageWriter(WRITER_QUEUE);
+		render_pool = new ThreadPool(RENDER_THREADS);
+		printf("Rendering with %u threads\n", render_pool->GetNumThreads());
+
 		do {
 			init_scene();
 
 			auto timeStart = std::chrono::high_resolution_clock::now();
-			renderScene();  //Just creating an image file
+			if (BENCHMARK_PIXEL_ORDER && Accel_Struct != NONE)
+				benchmarkPixelOrder();
+			else if (STREAM_OUTPUT)
+				renderStreamed();
+			else if (ANIMATION_FRAMES > 0)
+				renderAnimation();
+			else
+				renderScene();  //Just creating an image file
 			auto timeEnd = std::chrono::high_resolution_clock::now();
 			auto passedTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
 			printf("\nDone: %.2f (sec)\n", passedTime / 1000);
 			if (!P3F_scene) break;
 			cout << "\nPress 'y' to render another image or another key to terminate!\n";
 			delete(scene);
+			delete(light_sampler);
+			delete(irradiance_cache);
+			irradiance_cache = NULL;
 			free(img_Data);
+			free(samples_Data);
+			free(hdr_Data);
+			delete film;
+			film = NULL;
 			ch = _getch();
 		} while((toupper(ch) == 'Y')) ;
+
+		delete image_writer;  //waits for the images still in the queue
+		delete render_pool;
 	}
 
 	else {   //Use OpenGL to draw image in the screen
 		printf("OPENGL DRAWING MODE\n\n");
+		render_pool = new ThreadPool(RENDER_THREADS);  //also parses the meshes of the scene
+		printf("Rendering with %u threads\n", render_pool->GetNumThreads());
+
 		init_scene();
-		size_vertices = 2 * RES_X*RES_Y * sizeof(float);
-		size_colors = 3 * RES_X*RES_Y * sizeof(float);
-		vertices = (float*)malloc(size_vertices);
-		if (vertices == NULL) exit(1);
-		colors = (float*)malloc(size_colors);
-		if (colors == NULL) exit(1);
-		memset(colors, 0, size_colors);
+		accum_Data = (float*)malloc(3 * RES_X*RES_Y * sizeof(float));
+		if (accum_Data == NULL) exit(1);
+		frame_Data = (uint8_t*)calloc(4 * (size_t)RES_X * RES_Y, sizeof(uint8_t));
+		if (frame_Data == NULL) exit(1);
 
 		/* Setup GLUT and GLEW */
 		init(argc, argv);
+		startRenderThread();
 		glutMainLoop();
+		stopRenderThread();
+		delete render_pool;
 	}
 
-	free(colors);
-	free(vertices);
+	free(accum_Data);
+	free(frame_Data);
 	printf("Program ended normally\n");
 	exit(EXIT_SUCCESS);
 }
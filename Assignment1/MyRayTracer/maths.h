@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include "vector.h"
+#include "sampler.h"
 
 #define PI				3.141592653589793238462f
 
@@ -17,10 +18,12 @@ float rand_float(void);
 double rand_double(void);
 double rand_double(double min, double max);
 Vector rnd_unit_disk(void);
+Vector rnd_unit_disk(float u1, float u2);
 Vector rnd_unit_sphere(void);
 void set_rand_seed(const int seed);
 uint8_t u8fromfloat(float x);
 float u8tofloat(uint8_t x);
+unsigned int compact_bits(unsigned int x);
 
 // inlined functions
 
@@ -54,11 +57,11 @@ clamp(const double x, const double min, const double max) {
 
 
 // ---------------------------------------------------- rand_int
-// a wrapper for rand()
+// the random functions draw from the PCG32 generator of the calling thread (no shared state, unlike rand())
 
 inline int
 rand_int(void) {
-	return(rand());
+	return((int)(thread_rng().nextUInt() >> 1));
 }
 
 
@@ -66,7 +69,7 @@ rand_int(void) {
 
 inline float
 rand_float(void) {
-	return((float)rand() / ((float)RAND_MAX+1.0));
+	return(thread_rng().nextFloat());
 }
 
 
@@ -74,7 +77,7 @@ rand_float(void) {
 
 inline double
 rand_double(void) {
-	return((double)rand() / ((double)RAND_MAX + 1.0));
+	return(thread_rng().nextDouble());
 }
 
 // ---------------------------------------------------- rand_double(min, max)
@@ -85,28 +88,47 @@ rand_double(double min, double max) {
 }
 
 // ---------------------------------------------------- rnd_unit_disk
+// concentric mapping (Shirley-Chiu) of a point of the unit square onto the unit disk: no rejection loop
+
+inline Vector rnd_unit_disk(float u1, float u2) {
+	float a = 2.0f * u1 - 1.0f;
+	float b = 2.0f * u2 - 1.0f;
+	float r, phi;
+
+	if (a == 0.0f && b == 0.0f)
+		return Vector(0.0f, 0.0f, 0.0f);
+
+	if (a * a > b * b) {
+		r = a;
+		phi = (PI / 4) * (b / a);
+	}
+	else {
+		r = b;
+		phi = (PI / 2) - (PI / 4) * (a / b);
+	}
+	return Vector(r * cosf(phi), r * sinf(phi), 0.0f);
+}
 
 inline Vector rnd_unit_disk(void) {
-	Vector p;
-	do {
-		p = Vector(rand_float(), rand_float(), 0.0) * 2 - Vector(1.0, 1.0, 0.0);
-	} while (p * p >= 1.0);
-	return p;
+	return rnd_unit_disk(rand_float(), rand_float());
 }
 
 // ---------------------------------------------------- rnd_unit_sphere
+// uniform point inside the unit ball: uniform direction and radius cbrt(u)
 inline Vector rnd_unit_sphere(void) {
-	Vector p;
-	do {
-		p = Vector(rand_float(), rand_float(), rand_float()) * 2 - Vector(1.0, 1.0, 0.0);
-	} while (p * p >= 1.0);
-	return p;
+	float z = 2.0f * rand_float() - 1.0f;
+	float phi = 2.0f * PI * rand_float();
+	float r = cbrtf(rand_float());
+	float s = sqrtf(1.0f - z * z);
+
+	return Vector(s * cosf(phi), s * sinf(phi), z) * r;
 }
 
 // ---------------------------------------------------- set_rand_seed
+// seeds the generator of the calling thread, keeping its own stream
 inline void
 set_rand_seed(const int seed) {
-	srand(seed);
+	thread_rng().seed((uint64_t)seed, thread_rng().stream());
 }
 
 // ---------------------------------------------------- float to byte (unsigned char)
@@ -122,4 +144,16 @@ inline  float u8tofloat(uint8_t x)
 	return (float)(x / 255.99f);
 }
 
+// ---------------------------------------------------- compact_bits
+// gathers the even bits of x into its low half: the x coordinate of the Morton code x (the y one is compact_bits(x >> 1))
+inline unsigned int compact_bits(unsigned int x)
+{
+	x &= 0x55555555;
+	x = (x ^ (x >> 1)) & 0x33333333;
+	x = (x ^ (x >> 2)) & 0x0f0f0f0f;
+	x = (x ^ (x >> 4)) & 0x00ff00ff;
+	x = (x ^ (x >> 8)) & 0x0000ffff;
+	return x;
+}
+
 #endif
@@ -0,0 +1,516 @@
+#include <sstream>
+#include <string.h>
+#include <stdint.h>
+#include "mesh.h"
+#include "p3fReader.h"
+#include "macros.h"
+
+Mesh::Mesh() {}
+
+bool Mesh::Load(const char* name) {
+	size_t length = strlen(name);
+	const char* extension = length >= 4 ? name + length - 4 : "";
+	bool loaded;
+
+	if (_stricmp(extension, ".obj") == 0)
+		loaded = LoadOBJ(name);
+	else if (_stricmp(extension, ".ply") == 0)
+		loaded = LoadPLY(name);
+	else {
+		cerr << "Mesh '" << name << "': unknown file type (.obj or .ply expected).\n";
+		return false;
+	}
+	if (!loaded)
+		return false;
+
+	// point clouds and line sets have nothing to intersect (and the BVH needs a face for its root)
+	if (getNumFaces() == 0) {
+		cerr << "Mesh '" << name << "': no faces.\n";
+		vertices.clear();
+		return false;
+	}
+
+	// every face must index an existing vertex before the bounds are taken
+	for (int index : indices) {
+		if (index < 0 || index >= (int)vertices.size()) {
+			cerr << "Mesh '" << name << "': vertex index out of range.\n";
+			vertices.clear();
+			indices.clear();
+			return false;
+		}
+	}
+	Build();
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Wavefront OBJ: "v x y z" vertices and "f" polygons (fan triangulated) of vertex references "v", "v/vt", "v//vn" or
+// "v/vt/vn", counted from 1 or, when negative, back from the last vertex read. Every other statement is ignored
+
+static inline bool is_blank(char c) { return c == ' ' || c == '\t'; }
+
+//Vertex part of a face reference: the index up to the first '/', p moved past the whole reference
+static bool parse_obj_index(const char*& p, const char* end, int& index) {
+	bool negative = false;
+	int value = 0;
+	const char* start;
+
+	if (p < end && *p == '-') {
+		negative = true;
+		p++;
+	}
+	start = p;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		value = value * 10 + (*p - '0');
+	if (p == start)
+		return false;
+	while (p < end && (unsigned char)*p > ' ') p++;
+
+	index = negative ? -value : value;
+	return true;
+}
+
+bool Mesh::LoadOBJ(const char* name) {
+	P3FReader file;
+	vector<int> polygon;
+
+	if (!file.Open(name)) {
+		cerr << "Mesh '" << name << "': cannot open the file.\n";
+		return false;
+	}
+
+	const char* p = file.GetData();
+	const char* end = p + file.GetSize();
+	int line = 0;
+
+	while (p < end) {
+		const char* line_end = (const char*)memchr(p, '\n', end - p);
+		if (line_end == NULL) line_end = end;
+		line++;
+
+		while (p < line_end && is_blank(*p)) p++;
+
+		if (line_end - p > 1 && p[0] == 'v' && is_blank(p[1])) {
+			float xyz[3];
+			p++;
+			for (int i = 0; i < 3; i++) {
+				while (p < line_end && is_blank(*p)) p++;
+				p = P3FReader::ParseFloat(p, line_end, xyz[i]);
+				if (p == NULL) {
+					cerr << "Mesh '" << name << "': malformed vertex at line " << line << ".\n";
+					return false;
+				}
+			}
+			vertices.push_back(Vector(xyz[0], xyz[1], xyz[2]));
+		}
+		else if (line_end - p > 1 && p[0] == 'f' && is_blank(p[1])) {
+			int index;
+			polygon.clear();
+			p++;
+			while (true) {
+				while (p < line_end && (unsigned char)*p <= ' ') p++;
+				if (p >= line_end) break;
+				if (!parse_obj_index(p, line_end, index) || index == 0) {
+					cerr << "Mesh '" << name << "': malformed face at line " << line << ".\n";
+					return false;
+				}
+				polygon.push_back(index > 0 ? index - 1 : (int)vertices.size() + index);
+			}
+			for (int i = 2; i < (int)polygon.size(); i++) {
+				indices.push_back(polygon[0]);
+				indices.push_back(polygon[i - 1]);
+				indices.push_back(polygon[i]);
+			}
+		}
+		p = line_end + 1;
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Binary PLY (little or big endian). The x, y and z properties of the "vertex" element and the "vertex_indices" list
+// of the "face" element (fan triangulated) are read; other properties and elements are skipped
+
+enum PlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_INVALID };
+
+struct PlyProperty {
+	string name;
+	PlyType type;
+	bool list;
+	PlyType count_type;  //of the number of items of a list
+};
+
+struct PlyElement {
+	string name;
+	size_t count;
+	vector<PlyProperty> properties;
+};
+
+static PlyType ply_type(const string& name) {
+	if (name == "char" || name == "int8") return PLY_INT8;
+	if (name == "uchar" || name == "uint8") return PLY_UINT8;
+	if (name == "short" || name == "int16") return PLY_INT16;
+	if (name == "ushort" || name == "uint16") return PLY_UINT16;
+	if (name == "int" || name == "int32") return PLY_INT32;
+	if (name == "uint" || name == "uint32") return PLY_UINT32;
+	if (name == "float" || name == "float32") return PLY_FLOAT32;
+	if (name == "double" || name == "float64") return PLY_FLOAT64;
+	return PLY_INVALID;
+}
+
+static int ply_size(PlyType type) {
+	static const int sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+	return sizes[type];
+}
+
+//Value of the given type at p, whose bytes are reversed first when the file endianness differs from the machine's
+static double ply_read(const char* p, PlyType type, bool swap) {
+	unsigned char bytes[8];
+	int size = ply_size(type);
+
+	for (int i = 0; i < size; i++)
+		bytes[i] = p[swap ? size - 1 - i : i];
+
+	switch (type) {
+	case PLY_INT8: return (double)*(int8_t*)bytes;
+	case PLY_UINT8: return (double)*(uint8_t*)bytes;
+	case PLY_INT16: { int16_t v; memcpy(&v, bytes, 2); return v; }
+	case PLY_UINT16: { uint16_t v; memcpy(&v, bytes, 2); return v; }
+	case PLY_INT32: { int32_t v; memcpy(&v, bytes, 4); return v; }
+	case PLY_UINT32: { uint32_t v; memcpy(&v, bytes, 4); return v; }
+	case PLY_FLOAT32: { float v; memcpy(&v, bytes, 4); return v; }
+	default: { double v; memcpy(&v, bytes, 8); return v; }
+	}
+}
+
+bool Mesh::LoadPLY(const char* name) {
+	P3FReader file;
+	vector<PlyElement> elements;
+	bool swap;
+
+	if (!file.Open(name)) {
+		cerr << "Mesh '" << name << "': cannot open the file.\n";
+		return false;
+	}
+
+	const char* data = file.GetData();
+	const char* end = data + file.GetSize();
+	const char* header_end = NULL;
+
+	// the ascii header ends with the line "end_header"
+	for (const char* p = data; p < end; ) {
+		const char* line_end = (const char*)memchr(p, '\n', end - p);
+		if (line_end == NULL) break;
+		if (line_end - p >= 10 && strncmp(p, "end_header", 10) == 0) {
+			header_end = line_end + 1;
+			break;
+		}
+		p = line_end + 1;
+	}
+	if (file.GetSize() < 4 || strncmp(data, "ply", 3) != 0 || header_end == NULL) {
+		cerr << "Mesh '" << name << "': not a PLY file.\n";
+		return false;
+	}
+
+	istringstream header(string(data, header_end - data));
+	string line, format;
+
+	while (getline(header, line)) {
+		istringstream words(line);
+		string keyword;
+
+		words >> keyword;
+		if (keyword == "format") {
+			words >> format;
+		}
+		else if (keyword == "element") {
+			PlyElement element;
+			words >> element.name >> element.count;
+			elements.push_back(element);
+		}
+		else if (keyword == "property" && !elements.empty()) {
+			PlyProperty property;
+			string type;
+
+			words >> type;
+			property.list = type == "list";
+			if (property.list) {
+				string count_type, item_type;
+				words >> count_type >> item_type;
+				property.count_type = ply_type(count_type);
+				property.type = ply_type(item_type);
+			}
+			else {
+				property.count_type = PLY_INVALID;
+				property.type = ply_type(type);
+			}
+			words >> property.name;
+			if (property.type == PLY_INVALID || (property.list && property.count_type == PLY_INVALID)) {
+				cerr << "Mesh '" << name << "': unknown type of property '" << property.name << "'.\n";
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		}
+	}
+
+	if (format == "binary_little_endian") swap = false;
+	else if (format == "binary_big_endian") swap = true;
+	else {
+		cerr << "Mesh '" << name << "': only binary PLY files are supported.\n";
+		return false;
+	}
+
+	const char* p = header_end;
+	for (PlyElement& element : elements) {
+		bool is_vertex = element.name == "vertex";
+		bool is_face = element.name == "face";
+
+		if (is_vertex)
+			vertices.reserve(vertices.size() + element.count);
+		if (is_face)
+			indices.reserve(indices.size() + 3 * element.count);
+
+		for (size_t e = 0; e < element.count; e++) {
+			float xyz[3] = { 0.0f, 0.0f, 0.0f };
+			bool truncated = false;
+
+			// the sizes are compared with the bytes left, so no pointer goes past the end of the file
+			for (PlyProperty& property : element.properties) {
+				if (!property.list) {
+					if ((size_t)(end - p) < (size_t)ply_size(property.type)) {
+						truncated = true;
+						break;
+					}
+					if (is_vertex && property.name.size() == 1 && property.name[0] >= 'x' && property.name[0] <= 'z')
+						xyz[property.name[0] - 'x'] = (float)ply_read(p, property.type, swap);
+					p += ply_size(property.type);
+					continue;
+				}
+
+				if ((size_t)(end - p) < (size_t)ply_size(property.count_type)) {
+					truncated = true;
+					break;
+				}
+				int count = (int)ply_read(p, property.count_type, swap);
+				p += ply_size(property.count_type);
+				if (count < 0 || (size_t)(end - p) / ply_size(property.type) < (size_t)count) {
+					truncated = true;
+					break;
+				}
+
+				if (is_face && (property.name == "vertex_indices" || property.name == "vertex_index")) {
+					int first = (int)ply_read(p, property.type, swap);
+					int size = ply_size(property.type);
+					for (int i = 2; i < count; i++) {
+						indices.push_back(first);
+						indices.push_back((int)ply_read(p + (i - 1) * size, property.type, swap));
+						indices.push_back((int)ply_read(p + i * size, property.type, swap));
+					}
+				}
+				p += (size_t)count * ply_size(property.type);
+			}
+			if (truncated) {
+				cerr << "Mesh '" << name << "': the file ends inside element '" << element.name << "'.\n";
+				return false;
+			}
+			if (is_vertex)
+				vertices.push_back(Vector(xyz[0], xyz[1], xyz[2]));
+		}
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// BVH of the faces. Same splits as the scene BVH (middle of the longest axis, median when one side would be empty);
+// the faces are reordered so that every leaf indexes a contiguous run of them
+
+void Mesh::Build() {
+	int n_faces = getNumFaces();
+	vector<BuildPrimitive> prims(n_faces);
+
+	for (int f = 0; f < n_faces; f++) {
+		Vector& a = vertices[indices[3 * f]];
+		Vector& b = vertices[indices[3 * f + 1]];
+		Vector& c = vertices[indices[3 * f + 2]];
+
+		prims[f].min = Vector(MIN3(a.x, b.x, c.x), MIN3(a.y, b.y, c.y), MIN3(a.z, b.z, c.z));
+		prims[f].max = Vector(MAX3(a.x, b.x, c.x), MAX3(a.y, b.y, c.y), MAX3(a.z, b.z, c.z));
+		prims[f].centroid = (prims[f].min + prims[f].max) / 2;
+		prims[f].index = f;
+	}
+
+	nodes.clear();
+	nodes.reserve(2 * (size_t)MAX(n_faces, 1));
+	nodes.push_back(MeshNode());
+	BuildRecursive(prims, 0, 0, n_faces, 0);
+
+	vector<int> ordered(indices.size());
+	for (int f = 0; f < n_faces; f++)
+		for (int k = 0; k < 3; k++)
+			ordered[3 * f + k] = indices[3 * prims[f].index + k];
+	indices.swap(ordered);
+
+	bbox = AABB(nodes[0].min, nodes[0].max);
+	bbox.min -= EPSILON;
+	bbox.max += EPSILON;
+}
+
+void Mesh::BuildRecursive(vector<BuildPrimitive>& prims, int node, int left_index, int right_index, int depth) {
+	int n = right_index - left_index;
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	Vector cmin = min, cmax = max;  //bounds of the centroids
+
+	for (int i = left_index; i < right_index; i++) {
+		BuildPrimitive& prim = prims[i];
+		min = Vector(MIN(min.x, prim.min.x), MIN(min.y, prim.min.y), MIN(min.z, prim.min.z));
+		max = Vector(MAX(max.x, prim.max.x), MAX(max.y, prim.max.y), MAX(max.z, prim.max.z));
+		cmin = Vector(MIN(cmin.x, prim.centroid.x), MIN(cmin.y, prim.centroid.y), MIN(cmin.z, prim.centroid.z));
+		cmax = Vector(MAX(cmax.x, prim.centroid.x), MAX(cmax.y, prim.centroid.y), MAX(cmax.z, prim.centroid.z));
+	}
+	nodes[node].min = min;
+	nodes[node].max = max;
+
+	if (n <= LEAF_FACES || depth >= STACK_SIZE - 1) {
+		nodes[node].first = left_index;
+		nodes[node].n_faces = n;
+		return;
+	}
+
+	Vector diff = cmax - cmin;
+	int dim = (diff.x >= diff.y && diff.x >= diff.z) ? 0 : (diff.y >= diff.z ? 1 : 2);
+	float mid = (cmin.getAxisValue(dim) + cmax.getAxisValue(dim)) * 0.5f;
+
+	vector<BuildPrimitive>::iterator first = prims.begin() + left_index;
+	vector<BuildPrimitive>::iterator last = prims.begin() + right_index;
+	int split_index = partition(first, last, [&](BuildPrimitive& p) { return p.centroid.getAxisValue(dim) <= mid; }) - prims.begin();
+
+	if (split_index == left_index || split_index == right_index) {
+		split_index = left_index + n / 2;
+		nth_element(first, prims.begin() + split_index, last, [&](BuildPrimitive& a, BuildPrimitive& b) {
+			return a.centroid.getAxisValue(dim) < b.centroid.getAxisValue(dim);
+		});
+	}
+
+	int children = nodes.size();
+	nodes[node].first = children;
+	nodes[node].n_faces = 0;
+	nodes.push_back(MeshNode());
+	nodes.push_back(MeshNode());
+
+	BuildRecursive(prims, children, left_index, split_index, depth + 1);
+	BuildRecursive(prims, children + 1, split_index, right_index, depth + 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Intersection
+
+//Entry distance of the ray (origin o, inverse direction inv) into the box when it is closer than t_max
+static inline bool hit_box(const Vector& min, const Vector& max, const Vector& o, const Vector& inv, float t_max, float& t_near) {
+	float tx0 = (min.x - o.x) * inv.x, tx1 = (max.x - o.x) * inv.x;
+	float ty0 = (min.y - o.y) * inv.y, ty1 = (max.y - o.y) * inv.y;
+	float tz0 = (min.z - o.z) * inv.z, tz1 = (max.z - o.z) * inv.z;
+
+	float t0 = MAX(MAX(MIN(tx0, tx1), MIN(ty0, ty1)), MAX(MIN(tz0, tz1), 0.0f));
+	float t1 = MIN(MIN(MAX(tx0, tx1), MAX(ty0, ty1)), MAX(tz0, tz1));
+
+	t_near = t0;
+	return t0 <= t1 && t0 < t_max;
+}
+
+// Tomas Moller-Ben Trumbore, as Triangle::intercepts
+bool Mesh::IntersectFace(int face, const Ray& r, float& t, float& beta, float& gamma) const {
+	const Vector& p0 = vertices[indices[3 * face]];
+	Vector e1 = vertices[indices[3 * face + 1]] - p0;
+	Vector e2 = vertices[indices[3 * face + 2]] - p0;
+
+	Vector pvec = r.direction % e2;
+	float det = e1 * pvec;
+	if (fabs(det) < 1e-12f)
+		return false;
+
+	float inv_det = 1.0f / det;
+	Vector tvec = r.origin - p0;
+	beta = (tvec * pvec) * inv_det;
+	if (beta < 0.0f || beta > 1.0f)
+		return false;
+
+	Vector qvec = tvec % e1;
+	gamma = (r.direction * qvec) * inv_det;
+	if (gamma < 0.0f || beta + gamma > 1.0f)
+		return false;
+
+	t = (e2 * qvec) * inv_det;
+	return t > 0.0000001f;
+}
+
+bool Mesh::intercepts(const Ray& r, HitRecord& hit) const {
+	struct StackItem { int node; float t; } stack[STACK_SIZE];
+	int size = 0;
+	int node = 0;
+	float t_min = FLT_MAX;
+	float t_near;
+	Vector inv = Vector(1.0f / r.direction.x, 1.0f / r.direction.y, 1.0f / r.direction.z);
+	int face = -1;
+	float u = 0.0f, v = 0.0f;
+	if (nodes.empty() || !hit_box(nodes[0].min, nodes[0].max, r.origin, inv, t_min, t_near))
+		return false;
+
+	while (true) {
+		const MeshNode& current = nodes[node];
+
+		if (current.n_faces > 0) {
+			float t_face, beta, gamma;
+			for (int f = current.first; f < current.first + current.n_faces; f++) {
+				if (IntersectFace(f, r, t_face, beta, gamma) && t_face < t_min) {
+					t_min = t_face;
+					face = f;
+					u = beta;
+					v = gamma;
+				}
+			}
+		}
+		else {
+			float t_left, t_right;
+			bool left = hit_box(nodes[current.first].min, nodes[current.first].max, r.origin, inv, t_min, t_left);
+			bool right = hit_box(nodes[current.first + 1].min, nodes[current.first + 1].max, r.origin, inv, t_min, t_right);
+
+			// nearest child first, the other one waits on the stack
+			if (left && right) {
+				bool left_first = t_left <= t_right;
+				stack[size].node = left_first ? current.first + 1 : current.first;
+				stack[size++].t = left_first ? t_right : t_left;
+				node = left_first ? current.first : current.first + 1;
+				continue;
+			}
+			if (left || right) {
+				node = left ? current.first : current.first + 1;
+				continue;
+			}
+		}
+
+		// next node on the stack still closer than the closest hit
+		while (size > 0 && stack[size - 1].t >= t_min)
+			size--;
+		if (size == 0)
+			break;
+		node = stack[--size].node;
+	}
+
+	if (face < 0)
+		return false;
+	hit.t = t_min;
+	hit.face = face;
+	hit.u = u;
+	hit.v = v;
+	return true;
+}
+
+Vector Mesh::FaceNormal(int face) const {
+	const Vector& p0 = vertices[indices[3 * face]];
+	Vector normal = (vertices[indices[3 * face + 1]] - p0) % (vertices[indices[3 * face + 2]] - p0);
+	return normal.normalize();
+}
+
+Vector Mesh::getNormal(const HitRecord& hit) const {
+	return FaceNormal(hit.face);
+}
@@ -0,0 +1,58 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <vector>
+#include <string>
+#include "scene.h"
+#include "rayAccelerator.h"
+
+using namespace std;
+
+// --------------------------------------------------------------------- Mesh
+// Indexed triangle mesh imported from a Wavefront OBJ or a binary PLY file. The vertices and the faces (3 vertex
+// indices each) are read straight into flat arrays and the face bounds into the primitive array of the BVH builder,
+// so no Triangle object is made per face. The mesh is a single object for the scene accelerator and traverses its
+// own BVH of faces
+
+class Mesh : public Object
+{
+public:
+	Mesh();
+
+	//Loads a .obj or a .ply file (by extension) and builds the BVH of its faces. False with a message on failure
+	bool Load(const char* name);
+	bool LoadOBJ(const char* name);
+	bool LoadPLY(const char* name);
+
+	int getNumVertices() { return vertices.size(); }
+	int getNumFaces() { return indices.size() / 3; }
+
+	//Closest face hit by the ray, with the barycentric coordinates of the hit in it
+	bool intercepts(const Ray& r, HitRecord& hit) const;
+	Vector getNormal(const HitRecord& hit) const;  //of the face hit
+	AABB GetBoundingBox(void) { return bbox; }
+
+	Vector FaceNormal(int face) const;
+
+private:
+	//Leaves (n_faces > 0) index the faces from first, inner nodes have their children at first and first + 1
+	struct MeshNode {
+		Vector min, max;
+		int first;
+		int n_faces;
+	};
+
+	static const int STACK_SIZE = 64;
+	static const int LEAF_FACES = 4;
+
+	void Build();
+	void BuildRecursive(vector<BuildPrimitive>& prims, int node, int left_index, int right_index, int depth);
+	bool IntersectFace(int face, const Ray& r, float& t, float& beta, float& gamma) const;
+
+	vector<Vector> vertices;
+	vector<int> indices;
+	vector<MeshNode> nodes;
+	AABB bbox;
+};
+
+#endif
@@ -0,0 +1,410 @@
+#include <math.h>
+#include <stdint.h>
+#include "p3fReader.h"
+#include "macros.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const size_t MESH_CHUNK_TOKENS = 1 << 16;  //smaller mesh blocks are parsed by the calling thread alone
+static const size_t MESH_SAMPLE_TOKENS = 1024;    //tokens measured to estimate the length of a mesh block
+
+static const double powers_of_10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool is_space(char c) { return (unsigned char)c <= ' '; }
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static inline const char* skip_space(const char* p, const char* end) {
+	while (p < end && is_space(*p)) p++;
+	return p;
+}
+
+P3FReader::P3FReader() : data(NULL), end(NULL), cursor(NULL), size(0), failed(false) {
+#ifdef _WIN32
+	file_handle = INVALID_HANDLE_VALUE;
+	mapping_handle = NULL;
+#endif
+}
+
+P3FReader::~P3FReader() {
+	Close();
+}
+
+bool P3FReader::Open(const char* name) {
+	Close();
+	failed = false;
+
+#ifdef _WIN32
+	LARGE_INTEGER file_size;
+
+	file_handle = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_handle, &file_size)) {
+		Close();
+		return false;
+	}
+	size = (size_t)file_size.QuadPart;
+	if (size > 0) {
+		mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping_handle != NULL)
+			data = (const char*)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+		if (data == NULL) {
+			Close();
+			return false;
+		}
+	}
+#else
+	struct stat st;
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	size = (size_t)st.st_size;
+	if (size > 0) {
+		void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped != MAP_FAILED) {
+			data = (const char*)mapped;
+			madvise(mapped, size, MADV_SEQUENTIAL);
+		}
+	}
+	close(fd);  //the mapping keeps the file
+	if (size > 0 && data == NULL)
+		return false;
+#endif
+
+	cursor = data;
+	end = data + size;
+	return true;
+}
+
+void P3FReader::Close() {
+#ifdef _WIN32
+	if (data != NULL) UnmapViewOfFile(data);
+	if (mapping_handle != NULL) CloseHandle(mapping_handle);
+	if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+	mapping_handle = NULL;
+	file_handle = INVALID_HANDLE_VALUE;
+#else
+	if (data != NULL) munmap((void*)data, size);
+#endif
+	data = end = cursor = NULL;
+	size = 0;
+}
+
+const char* P3FReader::SkipSpace(const char* p) {
+	return skip_space(p, end);
+}
+
+bool P3FReader::NextToken(string& token) {
+	const char* p = SkipSpace(cursor);
+	const char* start = p;
+
+	if (p >= end)
+		return false;
+	while (p < end && !is_space(*p)) p++;
+	token.assign(start, p - start);
+	cursor = p;
+	return true;
+}
+
+float P3FReader::NextFloat() {
+	float value = 0.0f;
+	const char* p = failed ? NULL : ParseFloat(SkipSpace(cursor), end, value);
+
+	if (p == NULL) {
+		failed = true;
+		return 0.0f;
+	}
+	cursor = p;
+	return value;
+}
+
+int P3FReader::NextInt() {
+	int value = 0;
+	const char* p = failed ? NULL : ParseInt(SkipSpace(cursor), end, value);
+
+	if (p == NULL) {
+		failed = true;
+		return 0;
+	}
+	cursor = p;
+	return value;
+}
+
+Vector P3FReader::NextVector() {
+	float x = NextFloat();
+	float y = NextFloat();
+	float z = NextFloat();
+	return Vector(x, y, z);
+}
+
+Color P3FReader::NextColor() {
+	float r = NextFloat();
+	float g = NextFloat();
+	float b = NextFloat();
+	return Color(r, g, b);
+}
+
+void P3FReader::SkipLine() {
+	while (cursor < end && *cursor != '\n') cursor++;
+	if (cursor < end) cursor++;
+}
+
+// [sign] digits [. digits] [e [sign] digits]. The first 19 significant digits are kept in an integer, which a power of
+// ten then scales: exact up to 10^22, so the result is the correctly rounded double of the kept digits
+const char* P3FReader::ParseFloat(const char* p, const char* end, float& value) {
+	bool negative = false;
+	uint64_t mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+	for (; p < end && is_digit(*p); p++, digits++) {
+		if (mantissa < 1000000000000000000ull) mantissa = mantissa * 10 + (*p - '0');
+		else exponent++;
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && is_digit(*p); p++, digits++) {
+			if (mantissa < 1000000000000000000ull) {
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			}
+		}
+	}
+	if (digits == 0)
+		return NULL;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		bool negative_exponent = false;
+		int e = 0;
+
+		p++;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative_exponent = *p == '-';
+			p++;
+		}
+		if (p >= end || !is_digit(*p))
+			return NULL;
+		for (; p < end && is_digit(*p); p++)
+			if (e < 10000) e = e * 10 + (*p - '0');
+		exponent += negative_exponent ? -e : e;
+	}
+	if (p < end && !is_space(*p))
+		return NULL;
+
+	double v = (double)mantissa;
+	if (exponent < 0)
+		v = -exponent <= 22 ? v / powers_of_10[-exponent] : v * pow(10.0, exponent);
+	else if (exponent > 0)
+		v = exponent <= 22 ? v * powers_of_10[exponent] : v * pow(10.0, exponent);
+
+	value = (float)(negative ? -v : v);
+	return p;
+}
+
+const char* P3FReader::ParseInt(const char* p, const char* end, int& value) {
+	bool negative = false;
+	long long v = 0;
+	const char* start;
+
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+	start = p;
+	for (; p < end && is_digit(*p); p++)
+		if (v <= 0x7fffffff) v = v * 10 + (*p - '0');
+	if (p == start || (p < end && !is_space(*p)))
+		return NULL;
+
+	value = (int)(negative ? -v : v);
+	return p;
+}
+
+// Parses the tokens first..last-1 of the mesh block, the first of them starting at p: coordinates below n_coords,
+// vertex indices after. stop gets the position after the last one
+void P3FReader::ReadMeshChunk(const char* p, const char* chunk_end, size_t first, size_t last, size_t n_coords,
+	vector<Vector>& vertices, vector<int>& indices, const char*& stop, bool& chunk_failed) {
+
+	for (size_t k = first; k < last; k++) {
+		p = skip_space(p, chunk_end);
+		if (k < n_coords) {
+			float value;
+			p = ParseFloat(p, chunk_end, value);
+			if (p == NULL) break;
+
+			Vector& vertex = vertices[k / 3];
+			if (k % 3 == 0) vertex.x = value;
+			else if (k % 3 == 1) vertex.y = value;
+			else vertex.z = value;
+		}
+		else {
+			p = ParseInt(p, chunk_end, indices[k - n_coords]);
+			if (p == NULL) break;
+		}
+	}
+	chunk_failed = p == NULL;
+	stop = p;
+}
+
+bool P3FReader::ReadMesh(unsigned int n_vertices, unsigned int n_faces, vector<Vector>& vertices, vector<int>& indices, ThreadPool* pool) {
+	size_t n_coords = 3 * (size_t)n_vertices;
+	size_t n_tokens = n_coords + 3 * (size_t)n_faces;
+	const char* begin = SkipSpace(cursor);
+
+	vertices.resize(n_vertices);
+	indices.resize(3 * (size_t)n_faces);
+	if (failed)
+		return false;
+
+	if (pool == NULL || pool->GetNumThreads() == 1 || n_tokens < MESH_CHUNK_TOKENS) {
+		bool chunk_failed;
+		ReadMeshChunk(begin, end, 0, n_tokens, n_coords, vertices, indices, cursor, chunk_failed);
+		failed = chunk_failed;
+		if (failed) cursor = end;
+		return !failed;
+	}
+
+	// estimated end of the block, from the length of its first tokens: the rest of the file is not tokenized
+	size_t sampled = 0;
+	const char* p = begin;
+
+	for (; sampled < MESH_SAMPLE_TOKENS && p < end; sampled++) {
+		while (p < end && !is_space(*p)) p++;
+		p = skip_space(p, end);
+	}
+	size_t span = (size_t)((double)(p - begin) / MAX(sampled, (size_t)1) * n_tokens * 1.125) + 64;
+
+	// chunks of [begin, mesh_end), their bounds moved forward to white space so that no token is split. The estimate
+	// is doubled until the chunks hold every token of the block or reach the end of the file
+	int n_chunks = pool->GetNumThreads() * 4;
+	vector<const char*> bounds(n_chunks + 1);
+	vector<size_t> first(n_chunks + 1);
+
+	while (true) {
+		const char* mesh_end = span < (size_t)(end - begin) ? begin + span : end;
+		while (mesh_end < end && !is_space(*mesh_end)) mesh_end++;
+
+		bounds[0] = begin;
+		bounds[n_chunks] = mesh_end;
+		for (int i = 1; i < n_chunks; i++) {
+			const char* b = MAX(begin + (mesh_end - begin) * i / n_chunks, bounds[i - 1]);
+			while (b < mesh_end && !is_space(*b)) b++;
+			bounds[i] = b;
+		}
+
+		// tokens starting in every chunk, then the index of the first token of each chunk
+		pool->Run(n_chunks, [&](int i) {
+			size_t count = 0;
+			const char* q = bounds[i];
+
+			while (true) {
+				q = skip_space(q, bounds[i + 1]);
+				if (q >= bounds[i + 1]) break;
+				count++;
+				while (q < bounds[i + 1] && !is_space(*q)) q++;
+			}
+			first[i + 1] = count;
+		});
+		first[0] = 0;
+		for (int i = 1; i <= n_chunks; i++)
+			first[i] += first[i - 1];
+
+		if (first[n_chunks] >= n_tokens || mesh_end == end)
+			break;
+		span *= 2;
+	}
+
+	if (first[n_chunks] < n_tokens) {
+		failed = true;
+		cursor = end;
+		return false;
+	}
+
+	vector<const char*> stops(n_chunks, (const char*)NULL);
+	vector<char> chunk_failed(n_chunks, 0);
+
+	pool->Run(n_chunks, [&](int i) {
+		if (first[i] >= n_tokens)
+			return;
+		bool f;
+		ReadMeshChunk(bounds[i], bounds[i + 1], first[i], MIN(first[i + 1], n_tokens), n_coords, vertices, indices, stops[i], f);
+		chunk_failed[i] = f;
+	});
+
+	for (int i = 0; i < n_chunks; i++) {
+		if (chunk_failed[i]) {
+			failed = true;
+			cursor = end;
+			return false;
+		}
+		if (first[i] < n_tokens && first[i + 1] >= n_tokens)
+			cursor = stops[i];  //chunk of the last token
+	}
+	return true;
+}
+
+float P3FStreamReader::NextFloat() {
+	float value = 0.0f;
+
+	if (failed || !(file >> value)) {
+		failed = true;
+		return 0.0f;
+	}
+	return value;
+}
+
+int P3FStreamReader::NextInt() {
+	int value = 0;
+
+	if (failed || !(file >> value)) {
+		failed = true;
+		return 0;
+	}
+	return value;
+}
+
+Vector P3FStreamReader::NextVector() {
+	float x = NextFloat();
+	float y = NextFloat();
+	float z = NextFloat();
+	return Vector(x, y, z);
+}
+
+Color P3FStreamReader::NextColor() {
+	float r = NextFloat();
+	float g = NextFloat();
+	float b = NextFloat();
+	return Color(r, g, b);
+}
+
+void P3FStreamReader::SkipLine() {
+	string rest;
+	getline(file, rest);
+}
+
+bool P3FStreamReader::ReadMesh(unsigned int n_vertices, unsigned int n_faces, vector<Vector>& vertices, vector<int>& indices, ThreadPool* pool) {
+	vertices.resize(n_vertices);
+	indices.resize(3 * (size_t)n_faces);
+
+	for (unsigned int i = 0; i < n_vertices && !failed; i++)
+		vertices[i] = NextVector();
+	for (size_t i = 0; i < indices.size() && !failed; i++)
+		indices[i] = NextInt();
+	return !failed;
+}
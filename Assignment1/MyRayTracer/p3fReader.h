@@ -0,0 +1,90 @@
+#ifndef P3F_READER_H
+#define P3F_READER_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include "vector.h"
+#include "color.h"
+#include "threadPool.h"
+
+using namespace std;
+
+// --------------------------------------------------------------------- P3FReader
+// Tokenizer of P3F files. The file is memory mapped and the numbers are converted by hand (no stream, no locale), and
+// the vertices and faces of a mesh block are split into chunks parsed in parallel. A token is a run of characters
+// between white space; the reader stops converting (Failed()) at the first malformed number
+
+class P3FReader
+{
+public:
+	P3FReader();
+	~P3FReader();
+
+	bool Open(const char* name);
+	void Close();
+	bool Failed() { return failed; }
+
+	//The whole mapped file, for the readers of other formats
+	const char* GetData() { return data; }
+	size_t GetSize() { return size; }
+
+	//Next token; false at the end of the file
+	bool NextToken(string& token);
+	float NextFloat();
+	int NextInt();
+	Vector NextVector();
+	Color NextColor();
+	void SkipLine();
+
+	//The 3 * n_vertices coordinates and 3 * n_faces vertex indices of a mesh block, in parallel chunks when a pool is given
+	bool ReadMesh(unsigned int n_vertices, unsigned int n_faces, vector<Vector>& vertices, vector<int>& indices, ThreadPool* pool);
+
+	//Conversions from [p, end): the position after the number, NULL when there is no number there
+	static const char* ParseFloat(const char* p, const char* end, float& value);
+	static const char* ParseInt(const char* p, const char* end, int& value);
+
+private:
+	const char* SkipSpace(const char* p);
+	void ReadMeshChunk(const char* p, const char* chunk_end, size_t first, size_t last, size_t n_coords,
+		vector<Vector>& vertices, vector<int>& indices, const char*& stop, bool& chunk_failed);
+
+	const char* data;  //mapped file
+	const char* end;
+	const char* cursor;
+	size_t size;
+	bool failed;
+
+#ifdef _WIN32
+	void* file_handle;
+	void* mapping_handle;
+#endif
+};
+
+// --------------------------------------------------------------------- P3FStreamReader
+// Same tokens read through an ifstream, one at a time: the baseline of the loader benchmark
+
+class P3FStreamReader
+{
+public:
+	P3FStreamReader() : failed(false) {}
+
+	bool Open(const char* name) { file.open(name, ios::in); failed = false; return file.is_open(); }
+	bool Failed() { return failed; }
+
+	bool NextToken(string& token) { return (bool)(file >> token); }
+	float NextFloat();
+	int NextInt();
+	Vector NextVector();
+	Color NextColor();
+	void SkipLine();
+
+	//Sequential, the pool is not used
+	bool ReadMesh(unsigned int n_vertices, unsigned int n_faces, vector<Vector>& vertices, vector<int>& indices, ThreadPool* pool);
+
+private:
+	ifstream file;
+	bool failed;
+};
+
+#endif
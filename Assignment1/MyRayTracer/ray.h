@@ -6,9 +6,10 @@
 class Ray
 {
 public:
-	Ray(const Vector& o, const Vector& dir ) : origin(o), direction(dir) {};
+	Ray(const Vector& o, const Vector& dir, float t = 0.0f ) : origin(o), direction(dir), time(t) {};
 
 	Vector origin;
 	Vector direction;
+	float time;  //instant in the shutter interval [0, 1] (motion blur); secondary rays keep the time of their primary ray
 };
 #endif
\ No newline at end of file
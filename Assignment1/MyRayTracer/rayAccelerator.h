@@ -4,10 +4,47 @@
 #include <stack>
 #include <queue>
 #include <cmath>
+#include <algorithm>
 #include "scene.h"
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+//Bounds and centroid of a primitive, snapshotted once so the builders never call GetBoundingBox() while partitioning
+struct BuildPrimitive {
+	Vector min, max;  //over the whole shutter interval for moving objects
+	Vector min0, max0, min1, max1;  //at shutter open and close (motion blur); only filled by snapshot_primitives()
+	Vector centroid;
+	unsigned int index;  //index of the primitive in the objects vector given to Build()
+};
+
+//Fill the packed primitive array and return the bounding box that encloses all of them
+inline AABB snapshot_primitives(vector<Object*>& objs, vector<BuildPrimitive>& prims) {
+	AABB world_bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+
+	prims.resize(objs.size());
+	for (unsigned int i = 0; i < objs.size(); i++) {
+		AABB bbox = objs[i]->GetBoundingBox();
+		prims[i].min = bbox.min;
+		prims[i].max = bbox.max;
+		if (objs[i]->IsMoving()) {
+			AABB bbox0 = objs[i]->GetBoundingBoxAt(0.0f), bbox1 = objs[i]->GetBoundingBoxAt(1.0f);
+			prims[i].min0 = bbox0.min; prims[i].max0 = bbox0.max;
+			prims[i].min1 = bbox1.min; prims[i].max1 = bbox1.max;
+		}
+		else {
+			prims[i].min0 = prims[i].min1 = bbox.min;
+			prims[i].max0 = prims[i].max1 = bbox.max;
+		}
+		prims[i].centroid = bbox.centroid();
+		prims[i].index = i;
+		world_bbox.extend(bbox);
+	}
+	return world_bbox;
+}
+
 class Grid
 {
 public:
@@ -18,7 +55,7 @@ public:
 	void setAABB(AABB& bbox_);
 	Object* getObject(unsigned int index);
 	void Build(vector<Object*>& objs);   // set up grid cells
-	bool Traverse(Ray& ray, Object **hitobject, Vector& hitpoint);  //(const Ray& ray, double& tmin, ShadeRec& sr)
+	bool Traverse(Ray& ray, HitRecord& hit);  //closest hit, hit.object and hit.point included
 	bool Traverse(Ray& ray);  //Traverse for shadow ray
 
 private:
@@ -42,52 +79,117 @@ class BVH
 	public:
 		int dimension;
 
-		bool operator() (Object* a, Object* b) {
-			float ca = a->GetBoundingBox().centroid().getAxisValue(dimension);
-			float cb = b->GetBoundingBox().centroid().getAxisValue(dimension);
-			return ca < cb;
+		bool operator() (BuildPrimitive& a, BuildPrimitive& b) {
+			return a.centroid.getAxisValue(dimension) < b.centroid.getAxisValue(dimension);
+		}
+	};
+
+	//true for primitives whose centroid lies on the left of the split plane
+	class Partitioner {
+	public:
+		int dimension;
+		float mid;
+
+		bool operator() (BuildPrimitive& p) {
+			return p.centroid.getAxisValue(dimension) <= mid;
 		}
 	};
 
+	//With moving objects a node keeps its bounds at shutter open (bbox) and close (bbox1); the bounds at a time in
+	//between are interpolated, which encloses objects moving linearly
 	class BVHNode {
 	private:
 		AABB bbox;
+		AABB bbox1;
 		bool leaf;
 		unsigned int n_objs;
 		unsigned int index;	// if leaf == false: index to left child node,
 							// else if leaf == true: index to first Intersectable (Object *) in objects vector
+		int packet = -1;	// leaf of spheres only: index of their SpherePacket
 
 	public:
 		BVHNode(void);
 		void setAABB(AABB& bbox_);
+		void setAABB(AABB& bbox0_, AABB& bbox1_);
 		void makeLeaf(unsigned int index_, unsigned int n_objs_);
 		void makeNode(unsigned int left_index_);
 		bool isLeaf() { return leaf; }
 		unsigned int getIndex() { return index; }
 		unsigned int getNObjs() { return n_objs; }
+		void setPacket(int packet_) { packet = packet_; }
+		int getPacket() { return packet; }
 		AABB& getAABB() { return bbox; };
+		AABB getAABB(float time) { return AABB(bbox.min + (bbox1.min - bbox.min) * time, bbox.max + (bbox1.max - bbox.max) * time); }
+	};
+
+	//The spheres of a leaf made only of spheres, as arrays of their coordinates (structure of arrays), so one
+	//leaf is intersected in a single pass of 8 wide AVX instructions instead of a virtual intercepts() per sphere
+	static const int PACKET_SIZE = 8;
+
+	struct SpherePacket {
+		float cx[PACKET_SIZE], cy[PACKET_SIZE], cz[PACKET_SIZE];
+		float sq_radius[PACKET_SIZE];
+		int count;
 	};
 
 private:
 	int Threshold = 2;
+	int SphereThreshold = PACKET_SIZE;  //leaf size of the nodes made only of spheres, packed in a SpherePacket
+	bool sphere_packets = true;
+	vector<SpherePacket> packets;
+	vector<bool> is_sphere;  //only alive during Build(): the objects given that are plain Spheres
+
+	//Bit mask of the spheres of the packet hit closer than t_max, their distances (as Sphere::intercepts()) in t
+	static int packet_hits(SpherePacket& packet, Ray& ray, float t_max, float t[PACKET_SIZE]);
+	float build_cost = 0.0f;  //SAHCost() right after the last Build()
+	bool has_motion = false;  //some object moves: the traversal interpolates the node bounds at the time of the ray
 	vector<Object*> objects;
 	vector<BVH::BVHNode*> nodes;
+	vector<BuildPrimitive> primitives;  //only alive during Build()
 
 	struct StackItem {
 		BVHNode* ptr;
 		float t;
+		StackItem() { }
 		StackItem(BVHNode* _ptr, float _t) : ptr(_ptr), t(_t) { }
 	};
 
-	stack<StackItem> hit_stack;
+	//Traversal stack on the caller's stack frame, so several threads can traverse the same BVH. It never holds more
+	//items than the depth of the tree, which Build() keeps below STACK_SIZE
+	static const int STACK_SIZE = 64;
+
+	class TraversalStack {
+	public:
+		TraversalStack() : size(0) { }
+		bool empty() { return size == 0; }
+		void push(const StackItem& item) { items[size++] = item; }
+		StackItem& top() { return items[size - 1]; }
+		void pop() { size--; }
+
+	private:
+		StackItem items[STACK_SIZE];
+		int size;
+	};
 
 public:
 	BVH(void);
 	int getNumObjects();
 	
 	void Build(vector<Object*>& objects);
-	void build_recursive(int left_index, int right_index, BVHNode* node);
-	bool Traverse(Ray& ray, Object** hit_obj, Vector& hit_point);
+	void build_recursive(int left_index, int right_index, BVHNode* node, int depth = 0);
+	void pack_leaf(BVHNode* node);  //(re)fills the SpherePacket of the leaf from the current spheres
+	void SetSpherePackets(bool enable) { sphere_packets = enable; }  //before Build()
+	AABB getNodeAABB(BVHNode* node, float time) { return has_motion ? node->getAABB(time) : node->getAABB(); }
+	bool Traverse(Ray& ray, HitRecord& hit);  //closest hit, hit.object and hit.point included
 	bool Traverse(Ray& ray);
+
+	//Animation: after the objects moved, Refit() recomputes the bounds of every node from the current bounds of its
+	//objects, keeping the tree. The tree gets worse as the objects drift away from where it was built, so Update()
+	//rebuilds it instead once its SAH cost exceeds rebuild_ratio times the cost it had when built. True when rebuilt
+	void Refit();
+	bool Update(float rebuild_ratio);
+
+	//Surface area heuristic: expected node visits plus primitive intersections of a ray that hits the root
+	float SAHCost();
 };
 #endif
\ No newline at end of file
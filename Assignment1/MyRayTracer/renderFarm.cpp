@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include "renderFarm.h"
+#include "macros.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+static void close_socket(socket_t s) { closesocket(s); }
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+static void close_socket(socket_t s) { close(s); }
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL  //a worker that drops is a failed send, not a SIGPIPE
+#else
+#define SEND_FLAGS 0
+#endif
+
+static const int ACCEPT_POLL_MS = 100;  //how often the coordinator checks whether the image is finished
+
+// largest payloads accepted, so a bad header cannot make the receiver allocate gigabytes
+static const uint32_t MAX_SCENE_NAME = 1024;
+static const uint32_t READY_SIZE = sizeof(uint32_t) + sizeof(double);         //threads and load time
+static const uint32_t RESULT_HEADER = sizeof(int32_t) + sizeof(uint64_t) + sizeof(uint32_t);  //tile, samples, pixel values
+
+// Winsock is started once per process
+static bool farm_startup() {
+#ifdef _WIN32
+	static int result = [] { WSADATA wsa; return WSAStartup(MAKEWORD(2, 2), &wsa); }();
+	return result == 0;
+#else
+	return true;
+#endif
+}
+
+// small messages (jobs, results of small tiles) go out at once instead of waiting for more data
+static void set_no_delay(socket_t s) {
+	int on = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+}
+
+static double elapsed_ms(std::chrono::high_resolution_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+bool FarmConnection::Connect(const char* host, unsigned short port) {
+	struct addrinfo hints, *addresses = NULL;
+	char service[8];
+
+	Close();
+	if (!farm_startup())
+		return false;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	sprintf(service, "%u", port);
+	if (getaddrinfo(host, service, &hints, &addresses) != 0)
+		return false;
+
+	for (struct addrinfo* a = addresses; a != NULL && handle == -1; a = a->ai_next) {
+		socket_t s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (s == INVALID_SOCKET)
+			continue;
+		if (connect(s, a->ai_addr, (int)a->ai_addrlen) != 0) {
+			close_socket(s);
+			continue;
+		}
+		set_no_delay(s);
+		handle = (intptr_t)s;
+	}
+	freeaddrinfo(addresses);
+	return handle != -1;
+}
+
+void FarmConnection::Close() {
+	if (handle != -1)
+		close_socket((socket_t)handle);
+	handle = -1;
+}
+
+bool FarmConnection::SendAll(const void* data, size_t size) {
+	const char* p = (const char*)data;
+
+	while (size > 0) {
+		int sent = send((socket_t)handle, p, (int)MIN(size, (size_t)1 << 30), SEND_FLAGS);
+		if (sent <= 0)
+			return false;
+		p += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+bool FarmConnection::ReceiveAll(void* data, size_t size) {
+	char* p = (char*)data;
+
+	while (size > 0) {
+		int received = recv((socket_t)handle, p, (int)MIN(size, (size_t)1 << 30), 0);
+		if (received <= 0)
+			return false;
+		p += received;
+		size -= received;
+	}
+	return true;
+}
+
+bool FarmConnection::Send(uint32_t type, const void* data, uint32_t size) {
+	uint32_t header[2] = { type, size };
+	return handle != -1 && SendAll(header, sizeof(header)) && SendAll(data, size);
+}
+
+bool FarmConnection::Receive(uint32_t& type, vector<char>& data, uint32_t max_size) {
+	uint32_t header[2];
+
+	if (handle == -1 || !ReceiveAll(header, sizeof(header)) || header[1] > max_size)
+		return false;
+	type = header[0];
+	data.resize(header[1]);
+	return header[1] == 0 || ReceiveAll(&data[0], header[1]);
+}
+
+void FarmConnection::SetTimeout(int seconds) {
+#ifdef _WIN32
+	DWORD limit = seconds * 1000;
+#else
+	struct timeval limit = { seconds, 0 };
+#endif
+	setsockopt((socket_t)handle, SOL_SOCKET, SO_RCVTIMEO, (const char*)&limit, sizeof(limit));
+	setsockopt((socket_t)handle, SOL_SOCKET, SO_SNDTIMEO, (const char*)&limit, sizeof(limit));
+}
+
+// --------------------------------------------------------------------- Coordinator
+
+bool FarmCoordinator::Run(unsigned short port, const string& scene_name, int total_tiles, unsigned int tile_floats,
+	int timeout_s, const function<void(const FarmTileResult&)>& store_tile) {
+	struct sockaddr_in address;
+	int on = 1;
+
+	if (!farm_startup())
+		return false;
+
+	socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET)
+		return false;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if (::bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+		close_socket(listener);
+		return false;
+	}
+
+	scene = scene_name;
+	max_result = RESULT_HEADER + tile_floats * sizeof(float);
+	timeout = timeout_s;
+	store = store_tile;
+	n_tiles = total_tiles;
+	next_tile = stored = 0;
+	requeued.clear();
+	stats.clear();
+	printf("Render farm: %d tiles, waiting for workers on port %u\n", n_tiles, port);
+
+	// workers may join at any time until the last tile is stored
+	vector<FarmConnection*> connections;
+	vector<thread> servers;
+
+	while (true) {
+		{
+			lock_guard<mutex> guard(lock);
+			if (stored == n_tiles)
+				break;
+		}
+
+		fd_set ready;
+		struct timeval poll = { 0, ACCEPT_POLL_MS * 1000 };
+		FD_ZERO(&ready);
+		FD_SET(listener, &ready);
+		if (select((int)listener + 1, &ready, NULL, NULL, &poll) <= 0)
+			continue;
+
+		socket_t s = accept(listener, NULL, NULL);
+		if (s == INVALID_SOCKET)
+			continue;
+		set_no_delay(s);
+
+		FarmConnection* connection = new FarmConnection();
+		connection->handle = (intptr_t)s;
+		connection->SetTimeout(timeout);  //a hung worker is a dropped one
+		connections.push_back(connection);
+
+		int worker;
+		{
+			lock_guard<mutex> guard(lock);
+			worker = stats.size();
+			stats.push_back(FarmWorkerStats());
+		}
+		servers.push_back(thread(&FarmCoordinator::ServeWorker, this, connection, worker));
+	}
+	close_socket(listener);
+
+	for (unsigned int i = 0; i < servers.size(); i++) {
+		servers[i].join();
+		delete connections[i];
+	}
+	return true;
+}
+
+bool FarmCoordinator::NextBatch(unsigned int max_tiles, vector<int>& tiles) {
+	unique_lock<mutex> guard(lock);
+
+	// with nothing left to hand out, wait for the tiles in flight: a worker that drops gives its tiles back
+	tiles.clear();
+	tiles_changed.wait(guard, [&] { return !requeued.empty() || next_tile < n_tiles || stored == n_tiles; });
+
+	while (tiles.size() < max_tiles && !requeued.empty()) {
+		tiles.push_back(requeued.back());
+		requeued.pop_back();
+	}
+	while (tiles.size() < max_tiles && next_tile < n_tiles)
+		tiles.push_back(next_tile++);
+	return !tiles.empty();
+}
+
+void FarmCoordinator::Requeue(const vector<int>& tiles) {
+	lock_guard<mutex> guard(lock);
+	requeued.insert(requeued.end(), tiles.begin(), tiles.end());
+	tiles_changed.notify_all();
+}
+
+// Thread of the coordinator talking to one worker. The results come back in the order of the batch
+void FarmCoordinator::ServeWorker(FarmConnection* connection, int worker) {
+	FarmWorkerStats worker_stats = FarmWorkerStats();
+	uint32_t type;
+	vector<char> data;
+	vector<int> tiles;
+	FarmTileResult result;
+	bool failed = false;
+
+	if (!connection->Send(FARM_SCENE, scene.data(), (uint32_t)scene.size()) || !connection->Receive(type, data, READY_SIZE) ||
+		type != FARM_READY || data.size() != READY_SIZE) {
+		printf("Worker %d: no answer to the scene\n", worker);
+		failed = true;
+	}
+	else {
+		memcpy(&worker_stats.threads, &data[0], sizeof(uint32_t));
+		memcpy(&worker_stats.load_ms, &data[sizeof(uint32_t)], sizeof(double));
+		printf("Worker %d ready: %u threads, scene loaded in %.2f ms\n", worker, worker_stats.threads, worker_stats.load_ms);
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	while (!failed && NextBatch(MAX(worker_stats.threads, 1u), tiles)) {
+		unsigned int done = 0;
+
+		if (worker_stats.tiles == 0)
+			start = std::chrono::high_resolution_clock::now();
+
+		failed = !connection->Send(FARM_JOB, tiles.data(), (uint32_t)(tiles.size() * sizeof(int)));
+		for (; !failed && done < tiles.size(); done++) {
+			const size_t header = RESULT_HEADER;
+			int32_t tile;
+			uint64_t n_samples;
+			uint32_t n_pixels;
+
+			if (!connection->Receive(type, data, max_result) || type != FARM_RESULT || data.size() < header) {
+				failed = true;
+				break;
+			}
+			memcpy(&tile, &data[0], sizeof(int32_t));
+			memcpy(&n_samples, &data[sizeof(int32_t)], sizeof(uint64_t));
+			memcpy(&n_pixels, &data[sizeof(int32_t) + sizeof(uint64_t)], sizeof(uint32_t));
+			if (tile != tiles[done] || n_pixels > (data.size() - header) / sizeof(float)) {
+				failed = true;
+				break;
+			}
+
+			// the pixel values, then the film sums
+			result.tile = tile;
+			result.n_samples = n_samples;
+			result.pixels.resize(n_pixels);
+			result.film.resize((data.size() - header) / sizeof(float) - n_pixels);
+			if (!result.pixels.empty())
+				memcpy(&result.pixels[0], &data[header], result.pixels.size() * sizeof(float));
+			if (!result.film.empty())
+				memcpy(&result.film[0], &data[header + n_pixels * sizeof(float)], result.film.size() * sizeof(float));
+			store(result);
+
+			worker_stats.tiles++;
+			worker_stats.samples += n_samples;
+			worker_stats.busy_ms = elapsed_ms(start);
+
+			lock_guard<mutex> guard(lock);
+			stored++;
+			tiles_changed.notify_all();
+		}
+
+		if (failed) {
+			printf("Worker %d dropped, %u tiles handed to the others\n", worker, (unsigned int)(tiles.size() - done));
+			Requeue(vector<int>(tiles.begin() + done, tiles.end()));
+		}
+	}
+	if (!failed)
+		connection->Send(FARM_DONE, NULL, 0);
+	connection->Close();
+
+	worker_stats.failed = failed;
+	lock_guard<mutex> guard(lock);
+	stats[worker] = worker_stats;
+}
+
+void FarmCoordinator::PrintStats(double total_ms) {
+	lock_guard<mutex> guard(lock);
+
+	printf("Render farm: %d tiles by %d workers in %.2f s\n", n_tiles, (int)stats.size(), total_ms / 1000);
+	printf("  worker  threads   load (ms)  tiles   share  Msamples/s\n");
+	for (unsigned int w = 0; w < stats.size(); w++) {
+		FarmWorkerStats& s = stats[w];
+		printf("  %6u  %7u  %10.2f  %5d  %5.1f%%  %10.3f%s\n", w, s.threads, s.load_ms, s.tiles, 100.0 * s.tiles / n_tiles,
+			s.busy_ms > 0.0 ? s.samples / (s.busy_ms * 1000.0) : 0.0, s.failed ? "  (dropped)" : "");
+	}
+}
+
+// --------------------------------------------------------------------- Worker
+
+bool RunFarmWorker(const char* host, unsigned short port, unsigned int threads, const function<bool(const string&)>& load,
+	const function<void(const vector<int>&, vector<FarmTileResult>&)>& render) {
+	FarmConnection connection;
+	uint32_t type;
+	vector<char> data;
+	vector<int> tiles;
+	vector<FarmTileResult> results;
+	vector<char> message;
+	int rendered = 0;
+
+	if (!connection.Connect(host, port)) {
+		printf("Cannot connect to the coordinator at %s:%u\n", host, port);
+		return false;
+	}
+	if (!connection.Receive(type, data, MAX_SCENE_NAME) || type != FARM_SCENE)
+		return false;
+
+	string scene_name(data.begin(), data.end());
+	auto start = std::chrono::high_resolution_clock::now();
+	if (!load(scene_name)) {
+		printf("Cannot load the scene %s\n", scene_name.c_str());
+		return false;
+	}
+	double load_ms = elapsed_ms(start);
+
+	char ready[READY_SIZE];
+	memcpy(ready, &threads, sizeof(uint32_t));
+	memcpy(ready + sizeof(uint32_t), &load_ms, sizeof(double));
+	if (!connection.Send(FARM_READY, ready, sizeof(ready)))
+		return false;
+
+	// a batch holds one tile per thread at most
+	while (connection.Receive(type, data, MAX(threads, 1u) * sizeof(int))) {
+		if (type == FARM_DONE) {
+			printf("Render farm: %d tiles rendered for the coordinator\n", rendered);
+			return true;
+		}
+		if (type != FARM_JOB)
+			break;
+
+		tiles.resize(data.size() / sizeof(int));
+		if (!tiles.empty())
+			memcpy(&tiles[0], &data[0], tiles.size() * sizeof(int));
+		render(tiles, results);
+
+		for (unsigned int i = 0; i < results.size(); i++) {
+			int32_t tile = results[i].tile;
+			uint64_t n_samples = results[i].n_samples;
+			uint32_t n_pixels = (uint32_t)results[i].pixels.size();
+			size_t header = RESULT_HEADER;
+
+			message.resize(header + (n_pixels + results[i].film.size()) * sizeof(float));
+			memcpy(&message[0], &tile, sizeof(int32_t));
+			memcpy(&message[sizeof(int32_t)], &n_samples, sizeof(uint64_t));
+			memcpy(&message[sizeof(int32_t) + sizeof(uint64_t)], &n_pixels, sizeof(uint32_t));
+			if (n_pixels > 0)
+				memcpy(&message[header], &results[i].pixels[0], n_pixels * sizeof(float));
+			if (!results[i].film.empty())
+				memcpy(&message[header + n_pixels * sizeof(float)], &results[i].film[0], results[i].film.size() * sizeof(float));
+			if (!connection.Send(FARM_RESULT, &message[0], (uint32_t)message.size()))
+				return false;
+		}
+		rendered += results.size();
+	}
+	printf("Lost the coordinator\n");
+	return false;
+}
@@ -0,0 +1,97 @@
+#ifndef RENDER_FARM_H
+#define RENDER_FARM_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+// --------------------------------------------------------------------- Render farm
+// Distributed rendering over TCP (localhost or a LAN). A coordinator hands the tiles of an image out to worker
+// processes and assembles what they send back. Every worker loads the scene the coordinator names once, through the
+// memory mapped P3F reader, so the workers of one machine share the pages of the scene file, and builds its own
+// accelerator. The messages are a type and a size followed by the payload, in the byte order of the machine
+
+typedef enum { FARM_SCENE = 1, FARM_READY, FARM_JOB, FARM_RESULT, FARM_DONE } FarmMessage;
+
+class FarmConnection
+{
+public:
+	FarmConnection() : handle(-1) {}
+	~FarmConnection() { Close(); }
+
+	bool Connect(const char* host, unsigned short port);
+	void Close();
+
+	bool Send(uint32_t type, const void* data, uint32_t size);
+	//Blocks until a whole message is in; false when its payload is above max_size or the time limit runs out
+	bool Receive(uint32_t& type, vector<char>& data, uint32_t max_size);
+
+	void SetTimeout(int seconds);  //of every send and receive, 0: none
+
+private:
+	friend class FarmCoordinator;
+
+	bool SendAll(const void* data, size_t size);
+	bool ReceiveAll(void* data, size_t size);
+
+	intptr_t handle;  //socket, -1 when closed
+};
+
+//Tile rendered by a worker
+struct FarmTileResult {
+	int tile;
+	unsigned long long n_samples;
+	vector<float> pixels;  //per pixel of the tile, row by row: clamped color (3), hdr (3) and number of samples
+	vector<float> film;    //sums of the film tile (FilmTile) of the pixel filter, empty with the box filter
+};
+
+struct FarmWorkerStats {
+	unsigned int threads;
+	double load_ms;  //scene load and accelerator build
+	int tiles;
+	unsigned long long samples;
+	double busy_ms;  //from the first job sent to the last result received
+	bool failed;
+};
+
+class FarmCoordinator
+{
+public:
+	//Listens on port and hands the tiles 0..n_tiles-1 of the scene out to the workers that connect, a batch of one tile
+	//per worker thread at a time, calling store for every tile that comes back (tile_floats values at most). A
+	//worker that drops, or does not answer within timeout seconds (loading the scene or rendering a batch), is dropped
+	//and its tiles are handed to the others. Returns when every tile is stored; false when the port cannot be opened
+	bool Run(unsigned short port, const string& scene_name, int n_tiles, unsigned int tile_floats, int timeout,
+		const function<void(const FarmTileResult&)>& store);
+
+	void PrintStats(double total_ms);
+
+private:
+	void ServeWorker(FarmConnection* connection, int worker);
+	bool NextBatch(unsigned int max_tiles, vector<int>& tiles);  //false once every tile is stored
+	void Requeue(const vector<int>& tiles);
+
+	string scene;
+	uint32_t max_result;  //payload of a tile result
+	int timeout;
+	function<void(const FarmTileResult&)> store;
+
+	mutex lock;
+	condition_variable tiles_changed;  //tiles were stored or requeued
+	vector<int> requeued;
+	int next_tile;
+	int n_tiles, stored;
+	vector<FarmWorkerStats> stats;
+};
+
+//Worker side: connects to the coordinator, loads the scene it names with load (false: the worker gives up) and renders
+//the batches of tiles it receives with render until the coordinator is done. threads is the batch size it asks for
+bool RunFarmWorker(const char* host, unsigned short port, unsigned int threads, const function<bool(const string&)>& load,
+	const function<void(const vector<int>&, vector<FarmTileResult>&)>& render);
+
+#endif
@@ -0,0 +1,156 @@
+#include <cmath>
+#include "sampler.h"
+
+#define ONE_MINUS_EPSILON 0.99999994f  // largest float below 1
+
+// --------------------------------------------------------------------- hash
+// integer hash (lowbias32) used to decorrelate pixels and dimensions
+
+static inline uint32_t hash(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline uint32_t hash(int x, int y, unsigned int d) {
+	return hash((uint32_t)x ^ hash((uint32_t)y ^ hash(d)));
+}
+
+// 32 bits fixed point to [0, 1)
+static inline float to_float(uint32_t x) {
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+static inline float fract(float x) {
+	return x - floorf(x);
+}
+
+// --------------------------------------------------------------------- Sampler
+
+void Sampler::StartPixel(int x, int y, unsigned int sample_index) {
+	px = x;
+	py = y;
+	index = sample_index;
+	dimension = 0;
+}
+
+// --------------------------------------------------------------------- RandomSampler
+
+void RandomSampler::Get2D(float& u, float& v) {
+	PCG32& rng = thread_rng();
+	u = rng.nextFloat();
+	v = rng.nextFloat();
+	dimension++;
+}
+
+// --------------------------------------------------------------------- StratifiedSampler
+
+StratifiedSampler::StratifiedSampler(unsigned int spp) : Sampler(spp) {
+	n_strata = (unsigned int)sqrtf((float)spp);
+	if (n_strata < 1) n_strata = 1;
+}
+
+void StratifiedSampler::Get2D(float& u, float& v) {
+	unsigned int total = n_strata * n_strata;
+
+	// stride n_strata + 1 is coprime with n_strata^2: consecutive samples land far apart and all strata are visited,
+	// so a pixel that stops early (adaptive sampling) is still well covered. The offset shuffles the dimensions
+	unsigned int stratum = (index * (n_strata + 1) + (dimension == 0 ? 0 : hash(px, py, dimension))) % total;
+
+	PCG32& rng = thread_rng();
+	u = ((stratum / n_strata) + rng.nextFloat()) / n_strata;
+	v = ((stratum % n_strata) + rng.nextFloat()) / n_strata;
+
+	// the division may round up to 1 in the last stratum
+	if (u >= 1.0f) u = ONE_MINUS_EPSILON;
+	if (v >= 1.0f) v = ONE_MINUS_EPSILON;
+	dimension++;
+}
+
+// --------------------------------------------------------------------- SobolSampler
+
+static inline uint32_t reverse_bits(uint32_t x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+	x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+	x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+	x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+	return x;
+}
+
+// second Sobol dimension (the first one is the van der Corput sequence)
+static inline uint32_t sobol2(uint32_t i) {
+	uint32_t r = 0;
+	for (uint32_t v = 1U << 31; i; i >>= 1, v ^= v >> 1)
+		if (i & 1) r ^= v;
+	return r;
+}
+
+void SobolSampler::Get2D(float& u, float& v) {
+	uint32_t scramble = hash(px, py, dimension);
+
+	// every 2D dimension reuses the (0,2)-sequence; XOR-ing the index permutes it inside each power-of-two block
+	uint32_t i = index ^ (dimension == 0 ? 0 : (hash(scramble) & 0xffff));
+
+	u = to_float(reverse_bits(i) ^ scramble);
+	v = to_float(sobol2(i) ^ hash(scramble + 1));
+	dimension++;
+}
+
+// --------------------------------------------------------------------- BlueNoiseSampler
+
+void BlueNoiseSampler::Get2D(float& u, float& v) {
+	// plastic constant based R2 sequence (Roberts)
+	const float a1 = 0.7548776662466927f;
+	const float a2 = 0.5698402909980532f;
+
+	// interleaved gradient noise (Jimenez) of the pixel, shifted for each dimension
+	float x = px + 5.588238f * dimension;
+	float y = py + 5.588238f * dimension;
+	float rot_u = fract(52.9829189f * fract(0.06711056f * x + 0.00583715f * y));
+	float rot_v = fract(52.9829189f * fract(0.06711056f * y + 0.00583715f * x));
+
+	u = fract(0.5f + a1 * index + rot_u);
+	v = fract(0.5f + a2 * index + rot_v);
+	dimension++;
+}
+
+// --------------------------------------------------------------------- factory
+
+Sampler* create_sampler(SamplerType type, unsigned int spp) {
+	switch (type) {
+	case STRATIFIED_SAMPLER:
+		return new StratifiedSampler(spp);
+	case SOBOL_SAMPLER:
+		return new SobolSampler(spp);
+	case BLUE_NOISE_SAMPLER:
+		return new BlueNoiseSampler(spp);
+	default:
+		return new RandomSampler(spp);
+	}
+}
+
+static SamplerType sampler_type = STRATIFIED_SAMPLER;
+static unsigned int sampler_spp = 1;
+static std::atomic<unsigned int> sampler_generation(1);  // bumped by set_sampler() so every thread rebuilds its sampler
+
+void set_sampler(SamplerType type, unsigned int spp) {
+	sampler_type = type;
+	sampler_spp = spp;
+	sampler_generation++;
+}
+
+Sampler* thread_sampler() {
+	static thread_local Sampler* sampler = NULL;
+	static thread_local unsigned int generation = 0;
+
+	if (generation != sampler_generation) {
+		delete sampler;
+		sampler = create_sampler(sampler_type, sampler_spp);
+		generation = sampler_generation;
+	}
+	return sampler;
+}
@@ -0,0 +1,115 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include <atomic>
+
+//Type of pixel sampler
+typedef enum { RANDOM_SAMPLER, STRATIFIED_SAMPLER, SOBOL_SAMPLER, BLUE_NOISE_SAMPLER } SamplerType;
+
+// --------------------------------------------------------------------- PCG32
+// Small and fast PRNG (O'Neill, pcg32 XSH-RR): 64 bits of state plus a stream selector
+
+class PCG32
+{
+public:
+	PCG32(uint64_t initstate = 0x853c49e6748fea9bULL, uint64_t initseq = 0xda3e39cb94b95bdbULL) { seed(initstate, initseq); }
+
+	void seed(uint64_t initstate, uint64_t initseq) {
+		state = 0u;
+		inc = (initseq << 1u) | 1u;
+		nextUInt();
+		state += initstate;
+		nextUInt();
+	}
+
+	uint64_t stream() { return inc >> 1u; }
+
+	uint32_t nextUInt() {
+		uint64_t oldstate = state;
+		state = oldstate * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = (uint32_t)(((oldstate >> 18u) ^ oldstate) >> 27u);
+		uint32_t rot = (uint32_t)(oldstate >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+	}
+
+	// [0, 1) with the 24 bits a float can hold
+	float nextFloat() { return (nextUInt() >> 8) * (1.0f / 16777216.0f); }
+
+	double nextDouble() { return nextUInt() * (1.0 / 4294967296.0); }
+
+private:
+	uint64_t state, inc;
+};
+
+// Random number generator of the calling thread. Each thread gets its own stream, so the render threads never share state
+inline PCG32& thread_rng() {
+	static std::atomic<uint64_t> next_stream(1);
+	static thread_local PCG32 rng(0x853c49e6748fea9bULL, next_stream++);
+	return rng;
+}
+
+// --------------------------------------------------------------------- Sampler
+// Generates the 2D sample points of one pixel sample: the first Get2D() after StartPixel() is the position inside
+// the pixel, the next ones feed the lens and other effects. Samplers are per thread, see thread_sampler().
+
+class Sampler
+{
+public:
+	Sampler(unsigned int spp) : samples_per_pixel(spp) {}
+	virtual ~Sampler() {}
+
+	virtual void StartPixel(int x, int y, unsigned int sample_index);
+	virtual void Get2D(float& u, float& v) = 0;
+
+protected:
+	unsigned int samples_per_pixel;
+	int px, py;
+	unsigned int index;      // sample of the current pixel
+	unsigned int dimension;  // 2D dimensions already consumed by the current sample
+};
+
+//Independent uniform samples
+class RandomSampler : public Sampler
+{
+public:
+	RandomSampler(unsigned int spp) : Sampler(spp) {}
+	void Get2D(float& u, float& v);
+};
+
+//Jittered samples on a sqrt(spp) x sqrt(spp) grid of strata; every dimension visits the strata in a different order
+class StratifiedSampler : public Sampler
+{
+public:
+	StratifiedSampler(unsigned int spp);
+	void Get2D(float& u, float& v);
+
+private:
+	unsigned int n_strata;  // strata per side
+};
+
+//(0,2)-sequence Sobol points, randomized per pixel and per dimension with a random digit (XOR) scramble
+class SobolSampler : public Sampler
+{
+public:
+	SobolSampler(unsigned int spp) : Sampler(spp) {}
+	void Get2D(float& u, float& v);
+};
+
+//R2 low-discrepancy sequence rotated per pixel by interleaved gradient noise, which spreads the error as blue noise in screen space
+class BlueNoiseSampler : public Sampler
+{
+public:
+	BlueNoiseSampler(unsigned int spp) : Sampler(spp) {}
+	void Get2D(float& u, float& v);
+};
+
+Sampler* create_sampler(SamplerType type, unsigned int spp);
+
+//Sets the sampler that every thread builds on its next call to thread_sampler()
+void set_sampler(SamplerType type, unsigned int spp);
+
+//Sampler owned by the calling thread
+Sampler* thread_sampler();
+
+#endif
@@ -5,6 +5,10 @@
 #include "maths.h"
 #include "scene.h"
 #include "macros.h"
+#include "imageWriter.h"
+#include "p3fReader.h"
+#include "mesh.h"
+#include "instance.h"
 
 
 Triangle::Triangle(Vector& P0, Vector& P1, Vector& P2)
@@ -44,15 +48,15 @@ AABB Triangle::GetBoundingBox() {
 	return(AABB(Min, Max));
 }
 
-Vector Triangle::getNormal(Vector point)
+Vector Triangle::getNormal(const HitRecord& hit) const
 {	
-	return (normal.normalize());
+	return normal;  //normalized by the constructor
 }
 
 
 // Ray/Triangle intersection test using Tomas Moller-Ben Trumbore algorithm.
 
-bool Triangle::intercepts(Ray& ray, float& t) {
+bool Triangle::intercepts(const Ray& ray, HitRecord& hit) const {
 	Vector P0 = points[0];
 	Vector P1 = points[1];
 	Vector P2 = points[2];
@@ -90,12 +94,15 @@ bool Triangle::intercepts(Ray& ray, float& t) {
 		return false;
 	}
 
-	t = (a * (f * l - h * j) + b * (h * i - e * l) +  d * (e * j - f * i )) / denom;
+	float t = (a * (f * l - h * j) + b * (h * i - e * l) +  d * (e * j - f * i )) / denom;
 
 	if (t < 0.0000001f) {
 		return false;
 	}
 
+	hit.t = t;
+	hit.u = beta;
+	hit.v = gamma;
 	return true;
 
 }
@@ -123,7 +130,7 @@ Plane::Plane(Vector& P0, Vector& P1, Vector& P2)
 // Ray/Plane intersection test.
 //
 
-bool Plane::intercepts( Ray& r, float& t )
+bool Plane::intercepts( const Ray& r, HitRecord& hit ) const
 {
 	Vector N = PN;
 	Vector rayOrigin = r.origin;
@@ -133,19 +140,20 @@ bool Plane::intercepts( Ray& r, float& t )
 	if ((PN.length()) == 0.0) cerr << "DEGENERATED PLANE!\n";
 	if ((PN * rayDirection) == 0) return false;
 
-	t = -(rayOrigin * N + D) / (PN * rayDirection);
+	float t = -(rayOrigin * N + D) / (PN * rayDirection);
 
 	if (t < 0) return false;
+	hit.t = t;
 	return true;
 }
 
-Vector Plane::getNormal(Vector point) 
+Vector Plane::getNormal(const HitRecord& hit) const
 {
 	return PN;
 }
 
 
-bool Sphere::intercepts(Ray& r, float& t )
+bool Sphere::intercepts(const Ray& r, HitRecord& hit ) const
 {
 	Vector dir = r.direction;
 	Vector origin = r.origin;
@@ -167,22 +175,63 @@ bool Sphere::intercepts(Ray& r, float& t )
 	}
 
 	if (c > 0.0f) {
-		t = b - discr;
+		hit.t = b - discr;
 	}
 	else {
-		t = b + discr;
+		hit.t = b + discr;
 	}
 	return true;
 
 }
 
 
-Vector Sphere::getNormal( Vector point )
+Vector Sphere::getNormal( const HitRecord& hit ) const
 {
-	Vector normal = point - center;
+	Vector normal = hit.point - center;
 	return (normal.normalize());
 }
 
+MovingSphere::MovingSphere(Vector& a_center0, Vector& a_center1, float a_radius) :
+	center0(a_center0), center1(a_center1), radius(a_radius), SqRadius(a_radius * a_radius)
+{}
+
+// Sphere::intercepts with the center at the time of the ray
+bool MovingSphere::intercepts(const Ray& r, HitRecord& hit) const
+{
+	Vector OC = GetCenter(r.time) - r.origin;
+
+	float b = r.direction * OC;
+	float c = OC * OC - SqRadius;
+
+	if (c > 0.0f && b <= 0.0f)
+		return false;
+
+	float discr = sqrt(b * b - c);
+	if (discr <= 0.0f)
+		return false;
+
+	hit.t = c > 0.0f ? b - discr : b + discr;
+	hit.time = r.time;
+	return true;
+}
+
+Vector MovingSphere::getNormal(const HitRecord& hit) const
+{
+	Vector normal = hit.point - GetCenter(hit.time);
+	return (normal.normalize());
+}
+
+AABB MovingSphere::GetBoundingBox() {
+	AABB bbox = GetBoundingBoxAt(0.0f);
+	bbox.extend(GetBoundingBoxAt(1.0f));
+	return bbox;
+}
+
+AABB MovingSphere::GetBoundingBoxAt(float time) {
+	Vector center = GetCenter(time);
+	return AABB(Vector(center.x - radius, center.y - radius, center.z - radius), Vector(center.x + radius, center.y + radius, center.z + radius));
+}
+
 AABB Sphere::GetBoundingBox() {
 	Vector a_min;
 	Vector a_max ;
@@ -203,7 +252,7 @@ AABB aaBox::GetBoundingBox() {
 	return(AABB(min, max));
 }
 
-bool aaBox::intercepts(Ray& ray, float& t)
+bool aaBox::intercepts(const Ray& ray, HitRecord& hit) const
 {
 	// KAY - KAJIYA ALGORITHM
 
@@ -250,81 +299,21 @@ bool aaBox::intercepts(Ray& ray, float& t)
 	}
 
 	float tE, tL;				// Entering and leaving t values
-	Vector face_in, face_out;	// Normals 
 
-	// find largest tE, entering t value
-	if (tx_min > ty_min) {
-		tE = tx_min;
+	int face_in, face_out;		// faces (axis * 2, + 1 on the max side) crossed at tE and tL
 
-		if (a >= 0.0) {
-			face_in = Vector(-1, 0, 0);
-		} else {
-			face_in = Vector(1, 0, 0);
-		}
-	}
-	else {
-		tE = ty_min;
-
-		if (b >= 0.0) {
-			face_in = Vector(0, -1, 0);
-		}
-		else {
-			face_in = Vector(0, 1, 0);
-		}
-	}
-	if (tz_min > tE) {
-		tE = tz_min;
-
-		if (c >= 0.0) {
-			face_in = Vector(0, 0, -1);
-		}
-		else {
-			face_in = Vector(0, 0, 1);
-		}
-	}
+	// find largest tE, entering t value
+	tE = MAX3(tx_min, ty_min, tz_min);
+	face_in = tx_min >= ty_min && tx_min >= tz_min ? (a >= 0 ? 0 : 1) : ty_min >= tz_min ? (b >= 0 ? 2 : 3) : (c >= 0 ? 4 : 5);
 
 	// find smallest tL, leving t value
-	if (tx_max < ty_max) {
-		tL = tx_max;
-
-		if (a >= 0.0) {
-			face_out = Vector(1, 0, 0);
-		} else {
-			face_out = Vector(-1, 0, 0);
-		}
-	}
-	else {
-		tL = ty_max;
-		
-		if (b >= 0.0) {
-			face_out = Vector(0, 1, 0);
-		}
-		else {
-			face_out = Vector(0, -1, 0);
-		}
-	}
-
-	if (tz_max < tL) {
-		tL = tz_max;
-
-		if (c >= 0.0) {
-			face_out = Vector(0, 0, 1);
-		}
-		else {
-			face_out = Vector(0, 0, -1);
-		}
-	}
+	tL = MIN3(tx_max, ty_max, tz_max);
+	face_out = tx_max <= ty_max && tx_max <= tz_max ? (a >= 0 ? 1 : 0) : ty_max <= tz_max ? (b >= 0 ? 3 : 2) : (c >= 0 ? 5 : 4);
 
 	// condition for a hit
 	if (tE < tL && tL > 0) {
-		if (tE > 0) {
-			t = tE;
-			Normal = face_in;
-		}
-		else {
-			t = tL;
-			Normal = face_out;
-		}
+		hit.t = tE > 0 ? tE : tL;
+		hit.face = tE > 0 ? face_in : face_out;
 		return true;
 	}
 	else {
@@ -332,10 +321,75 @@ bool aaBox::intercepts(Ray& ray, float& t)
 	}
 }
 
-Vector aaBox::getNormal(Vector point)
+// Outward normal of the face intercepts() found
+Vector aaBox::getNormal(const HitRecord& hit) const
+{
+	static const Vector face_normal[6] = { Vector(-1, 0, 0), Vector(1, 0, 0), Vector(0, -1, 0),
+										   Vector(0, 1, 0), Vector(0, 0, -1), Vector(0, 0, 1) };
+	return face_normal[hit.face];
+}
+
+// --------------------------------------------------------------------- Light
+
+void Light::SetRectangle(Vector& u, Vector& v)
+{
+	type = RECT_LIGHT;
+	edge_u = u;
+	edge_v = v;
+}
+
+void Light::SetDisk(Vector& normal, float r)
 {
+	Vector n = normal;
+	n.normalize();
+
+	// any two axes of the disk plane
+	Vector helper = fabs(n.x) > 0.9f ? Vector(0.0f, 1.0f, 0.0f) : Vector(1.0f, 0.0f, 0.0f);
+	edge_u = (helper % n).normalize() * r;
+	edge_v = (n % edge_u).normalize() * r;
+
+	type = DISK_LIGHT;
+	radius = r;
+}
+
+void Light::SetSphere(float r)
+{
+	type = SPHERE_LIGHT;
+	radius = r;
+}
+
+Vector Light::SamplePoint(float u, float v, Vector& from)
+{
+	switch (type) {
+	case RECT_LIGHT:
+		return position + edge_u * (u - 0.5f) + edge_v * (v - 0.5f);
+
+	case DISK_LIGHT: {
+		Vector d = rnd_unit_disk(u, v);
+		return position + edge_u * d.x + edge_v * d.y;
+	}
+
+	case SPHERE_LIGHT: {
+		// uniform point of the hemisphere around the direction towards from
+		Vector w = from - position;
+		float dist = w.length();
+		if (dist <= radius)
+			return position;
+		w = w / dist;
+
+		Vector helper = fabs(w.x) > 0.9f ? Vector(0.0f, 1.0f, 0.0f) : Vector(1.0f, 0.0f, 0.0f);
+		Vector a = (helper % w).normalize();
+		Vector b = w % a;
+
+		float z = u;  // cos of the angle to w, uniform in [0, 1) for a uniform hemisphere
+		float s = sqrtf(MAX(0.0f, 1.0f - z * z));
+		float phi = 2.0f * PI * v;
+		return position + (a * (s * cosf(phi)) + b * (s * sinf(phi)) + w * z) * radius;
+	}
 
-	return (Normal.normalize());
+	default:
+		return position;
+	}
 }
 
 Scene::Scene()
@@ -363,6 +417,22 @@ void Scene::addObject(Object* o)
 }
 
 
+void Scene::addShape(Object* o)
+{
+	if (pending_prototype.empty()) {
+		objects.push_back(o);
+		return;
+	}
+	prototypes[pending_prototype] = o;
+	pending_prototype.clear();
+}
+
+Object* Scene::getPrototype(const string& name)
+{
+	map<string, Object*>::iterator it = prototypes.find(name);
+	return it == prototypes.end() ? NULL : it->second;
+}
+
 Object* Scene::getObject(unsigned int index)
 {
 	if (index >= 0 && index < objects.size())
@@ -409,6 +479,9 @@ void Scene::LoadSkybox(const char *sky_dir)
 	
 	ILuint ImageName;
 
+	//the image writer thread may be using DevIL at the same time
+	lock_guard<mutex> devil_lock(devil_mutex());
+
 	ilEnable(IL_ORIGIN_SET);
 	ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
 
@@ -530,85 +603,126 @@ Color Scene::GetSkyboxColor(Ray& r) {
 ////////////////////////////////////////////////////////////////////////////////
 // P3F file parsing methods.
 //
-void next_token(ifstream& file, char *token, const char *name)
+template <class Reader>
+void next_token(Reader& reader, string& token, const char *name)
 {
-  file >> token;
-  if (strcmp(token, name))
+  reader.NextToken(token);
+  if (token != name)
     cerr << "'" << name << "' expected.\n";
 }
 
-bool Scene::load_p3f(const char *name)
+// Mesh of the import command: a .obj or .ply file named relative to the directory of the P3F file. NULL if it fails
+Object* import_mesh(const char* p3f_name, const string& file, Material* material)
+{
+  string path = p3f_name;
+  size_t slash = path.find_last_of("/\\");
+
+  path = (slash == string::npos ? string() : path.substr(0, slash + 1)) + file;
+
+  Mesh* mesh = new Mesh();
+  if (!mesh->Load(path.c_str())) {
+    delete mesh;
+    return NULL;
+  }
+  if (material) mesh->SetMaterial(material);
+  printf("Mesh '%s': %d vertices, %d triangles.\n", path.c_str(), mesh->getNumVertices(), mesh->getNumFaces());
+  return (Object*)mesh;
+}
+
+// Instance of the prototype (named name) for the i command. NULL if there is no such prototype or the transform is singular
+Object* new_instance(Object* prototype, const string& name, const float rows[12], Material* material)
+{
+  Transform object_to_world = Transform(rows);
+  Transform inverse;
+
+  if (prototype == NULL) {
+    cerr << "unknown prototype '" << name << "'.\n";
+    return NULL;
+  }
+  if (!object_to_world.Inverse(inverse)) {
+    cerr << "singular transform for an instance of '" << name << "'.\n";
+    return NULL;
+  }
+
+  Instance* instance = new Instance(prototype, object_to_world);
+  if (material) instance->SetMaterial(material);
+  return (Object*)instance;
+}
+
+// The triangles of the meshes are built in parallel on the pool, when one is given
+template <class Reader>
+bool Scene::parse_p3f(Reader& reader, const char *name, ThreadPool* pool)
 {
-  const	int	lineSize = 1024;
   string	cmd;
-  char		token	[256];
-  ifstream	file(name, ios::in);
+  string	token;
   Material *	material;
 
   material = NULL;
 
-  if (file >> cmd)
+  while (reader.NextToken(cmd))
   {
-    while (true)
-    {
       if (cmd == "accel") {  //Acceleration data structure
-		unsigned int accel_type; // type of acceleration data structure
-		file >> accel_type;
-		this->SetAccelStruct((accelerator)accel_type);
+		this->SetAccelStruct((accelerator)reader.NextInt());
 	  }
 
 	  else if (cmd == "spp")    //samples per pixel
 	  {
-		  unsigned int spp; // number of samples per pixel 
-
-		  file >> spp;
-		  this->SetSamplesPerPixel(spp);
+		  this->SetSamplesPerPixel((unsigned int)reader.NextInt());
 	  }
 	  else if (cmd == "f")   //Material
       {
-	    double Kd, Ks, Shine, T, ior;
-	    Color cd, cs;
-
-	    file >> cd >> Kd >> cs >> Ks >> Shine >> T >> ior;
+	    Color cd = reader.NextColor();
+	    float Kd = reader.NextFloat();
+	    Color cs = reader.NextColor();
+	    float Ks = reader.NextFloat();
+	    float Shine = reader.NextFloat();
+	    float T = reader.NextFloat();
+	    float ior = reader.NextFloat();
 
 	    material = new Material(cd, Kd, cs, Ks, Shine, T, ior);
       }
 
       else if (cmd == "s")    //Sphere
       {
-	     Vector center;
-    	 float radius;
-         Sphere* sphere;
+	    Vector center = reader.NextVector();
+	    float radius = reader.NextFloat();
+        Sphere* sphere = new Sphere(center, radius);
 
-	    file >> center >> radius;
-        sphere = new Sphere(center,radius);
 	    if (material) sphere->SetMaterial(material);
-        this->addObject( (Object*) sphere);
+        this->addShape( (Object*) sphere);
+      }
+
+      else if (cmd == "ms")    //Moving sphere: center at shutter open, center at shutter close, radius
+      {
+	    Vector center0 = reader.NextVector();
+	    Vector center1 = reader.NextVector();
+	    float radius = reader.NextFloat();
+        MovingSphere* sphere = new MovingSphere(center0, center1, radius);
+
+	    if (material) sphere->SetMaterial(material);
+        this->addShape( (Object*) sphere);
       }
 
 	  else if (cmd == "box")    //axis aligned box
 	  {
-		  Vector minpoint, maxpoint;
-		  aaBox	*box;
+		  Vector minpoint = reader.NextVector();
+		  Vector maxpoint = reader.NextVector();
+		  aaBox* box = new aaBox(minpoint, maxpoint);
 
-		  file >> minpoint >> maxpoint;
-		  box = new aaBox(minpoint, maxpoint);
 		  if (material) box->SetMaterial(material);
-		  this->addObject((Object*)box);
+		  this->addShape((Object*)box);
 	  }
 	  else if (cmd == "p")  // Polygon: just accepts triangles for now
       {
-		  Vector P0, P1, P2;
-		  Triangle* triangle;
-		  unsigned total_vertices;
-		  
-		  file >> total_vertices;
-		  if (total_vertices == 3)
+		  if (reader.NextInt() == 3)
 		  {
-			  file >> P0 >> P1 >> P2;
-			  triangle = new Triangle(P0, P1, P2);
+			  Vector P0 = reader.NextVector();
+			  Vector P1 = reader.NextVector();
+			  Vector P2 = reader.NextVector();
+			  Triangle* triangle = new Triangle(P0, P1, P2);
+
 			  if (material) triangle->SetMaterial(material);
-			  this->addObject( (Object*) triangle);
+			  this->addShape( (Object*) triangle);
 		  }
 		  else
 		  {
@@ -616,128 +730,215 @@ bool Scene::load_p3f(const char *name)
 			  break;
 		  }
       }
-      
+
 	  else if (cmd == "mesh") {
-		  unsigned total_vertices, total_faces;
-		  unsigned P0, P1, P2;
-		  Triangle* triangle;
-		  Vector* verticesArray, vertex;
-
-		  file >> total_vertices >> total_faces;
-		  verticesArray = (Vector*)malloc(total_vertices * sizeof(Vector));
-		  for (int i = 0; i < total_vertices; i++) {
-			  file >> vertex;
-			  verticesArray[i] = vertex;
-		  }
-		  for (int i = 0; i < total_faces; i++) {
-			  file >> P0 >> P1 >> P2;
-			  if (P0 > 0) {
-				  P0 -= 1;
-				  P1 -= 1;
-				  P2 -= 1;
-			  }
-			  else {
-				  P0 += total_vertices;
-				  P1 += total_vertices;
-				  P2 += total_vertices;
+		  int total_vertices = reader.NextInt();
+		  int total_faces = reader.NextInt();
+		  vector<Vector> vertices;
+		  vector<int> indices;
+
+		  if (reader.Failed() || total_vertices < 0 || total_faces < 0 ||
+			  !reader.ReadMesh(total_vertices, total_faces, vertices, indices, pool))
+			  break;
+
+		  // vertex indices start at 1, negative ones count from the end
+		  for (int& index : indices)
+			  index = index > 0 ? index - 1 : index + total_vertices;
+
+		  vector<Object*> triangles(total_faces);
+		  int n_chunks = pool != NULL ? (int)pool->GetNumThreads() * 4 : 1;
+		  auto build = [&](int chunk) {
+			  int first = (int)((long long)total_faces * chunk / n_chunks);
+			  int last = (int)((long long)total_faces * (chunk + 1) / n_chunks);
+
+			  for (int i = first; i < last; i++) {
+				  int* face = &indices[3 * (size_t)i];
+				  if (face[0] < 0 || face[0] >= total_vertices || face[1] < 0 || face[1] >= total_vertices ||
+					  face[2] < 0 || face[2] >= total_vertices) {
+					  triangles[i] = NULL;
+					  continue;
+				  }
+				  Triangle* triangle = new Triangle(vertices[face[0]], vertices[face[1]], vertices[face[2]]);
+				  if (material) triangle->SetMaterial(material);
+				  triangles[i] = (Object*)triangle;
 			  }
-			  triangle = new Triangle(verticesArray[P0], verticesArray[P1], verticesArray[P2]); //vertex index start at 1
-			  if (material) triangle->SetMaterial(material);
-			  this->addObject((Object*)triangle);
+		  };
+		  if (pool != NULL) pool->Run(n_chunks, build);
+		  else build(0);
+
+		  for (Object* triangle : triangles) {
+			  if (triangle != NULL) this->addObject(triangle);
+			  else cerr << "Mesh face with a vertex index out of range.\n";
 		  }
+	  }
 
+	  else if (cmd == "import")  // Triangle mesh from a Wavefront OBJ or binary PLY file
+	  {
+		  reader.NextToken(token);
+
+		  Object* mesh = import_mesh(name, token, material);
+		  if (mesh == NULL) break;
+		  this->addShape(mesh);
+	  }
+
+	  else if (cmd == "object")  // the next shape is a prototype: only its instances are rendered
+	  {
+		  reader.NextToken(token);
+		  this->definePrototype(token);
+	  }
+
+	  else if (cmd == "i")  // Instance of a prototype: 3x4 object to world transform, row by row
+	  {
+		  float rows[12];
+
+		  reader.NextToken(token);
+		  for (int k = 0; k < 12; k++)
+			  rows[k] = reader.NextFloat();
+
+		  Object* instance = new_instance(this->getPrototype(token), token, rows, material);
+		  if (instance == NULL) break;
+		  this->addObject(instance);
 	  }
 
 	  else if (cmd == "pl")  // General Plane
 	  {
-          Vector P0, P1, P2;
-		  Plane* plane;
+          Vector P0 = reader.NextVector();
+          Vector P1 = reader.NextVector();
+          Vector P2 = reader.NextVector();
+		  Plane* plane = new Plane(P0, P1, P2);
 
-          file >> P0 >> P1 >> P2;
-          plane = new Plane(P0, P1, P2);
 	      if (material) plane->SetMaterial(material);
           this->addObject( (Object*) plane);
 	  }
 
       else if (cmd == "l")  // Need to check light color since by default is white
       {
-	    Vector pos;
-        Color color;
+	    Vector pos = reader.NextVector();
+        Color color = reader.NextColor();
+
+	    this->addLight(new Light(pos, color));
+      }
+      else if (cmd == "lr")  // Rectangle area light: center, two edges, color
+      {
+	    Vector pos = reader.NextVector();
+	    Vector edge_u = reader.NextVector();
+	    Vector edge_v = reader.NextVector();
+        Color color = reader.NextColor();
+
+	    Light* light = new Light(pos, color);
+	    light->SetRectangle(edge_u, edge_v);
+	    this->addLight(light);
+      }
+      else if (cmd == "ld")  // Disk area light: center, normal, radius, color
+      {
+	    Vector pos = reader.NextVector();
+	    Vector normal = reader.NextVector();
+	    float radius = reader.NextFloat();
+        Color color = reader.NextColor();
+
+	    Light* light = new Light(pos, color);
+	    light->SetDisk(normal, radius);
+	    this->addLight(light);
+      }
+      else if (cmd == "ls")  // Sphere area light: center, radius, color
+      {
+	    Vector pos = reader.NextVector();
+	    float radius = reader.NextFloat();
+        Color color = reader.NextColor();
 
-	    file >> pos >> color;
-	    
-	      this->addLight(new Light(pos, color));
-	    
+	    Light* light = new Light(pos, color);
+	    light->SetSphere(radius);
+	    this->addLight(light);
       }
       else if (cmd == "v")
       {
 	    Vector up, from, at;
 	    float fov, hither;
 	    int xres, yres;
-        Camera* camera;
 		float focal_ratio; //ratio beteween the focal distance and the viewplane distance
 		float aperture_ratio; // number of times to be multiplied by the size of a pixel
 
-	    next_token (file, token, "from");
-	    file >> from;
+	    next_token (reader, token, "from");
+	    from = reader.NextVector();
 
-	    next_token (file, token, "at");
-	    file >> at;
+	    next_token (reader, token, "at");
+	    at = reader.NextVector();
 
-	    next_token (file, token, "up");
-	    file >> up;
+	    next_token (reader, token, "up");
+	    up = reader.NextVector();
 
-	    next_token (file, token, "angle");
-	    file >> fov;
+	    next_token (reader, token, "angle");
+	    fov = reader.NextFloat();
 
-	    next_token (file, token, "hither");
-	    file >> hither;
+	    next_token (reader, token, "hither");
+	    hither = reader.NextFloat();
 
-	    next_token (file, token, "resolution");
-	    file >> xres >> yres;
+	    next_token (reader, token, "resolution");
+	    xres = reader.NextInt();
+	    yres = reader.NextInt();
 
-		next_token(file, token, "aperture");
-		file >> aperture_ratio;
+		next_token(reader, token, "aperture");
+		aperture_ratio = reader.NextFloat();
 
-		next_token(file, token, "focal");
-		file >> focal_ratio;
+		next_token(reader, token, "focal");
+		focal_ratio = reader.NextFloat();
 	    // Create Camera
-		camera = new Camera( from, at, up, fov, hither, 100.0*hither, xres, yres, aperture_ratio, focal_ratio);
-        this->SetCamera(camera);
+        this->SetCamera(new Camera( from, at, up, fov, hither, 100.0*hither, xres, yres, aperture_ratio, focal_ratio));
       }
 
       else if (cmd == "bclr")   //Background color
       {
-		Color bgcolor;
-		file >> bgcolor;
-		this->SetBackgroundColor(bgcolor);
+		this->SetBackgroundColor(reader.NextColor());
 	  }
-	
+
 	  else if (cmd == "env")
 	  {
-		  file >> token;
-		  
-		  this->LoadSkybox(token);
+		  reader.NextToken(token);
+
+		  this->LoadSkybox(token.c_str());
 		  this->SetSkyBoxFlg(true);
 	  }
       else if (cmd[0] == '#')
       {
-	    file.ignore (lineSize, '\n');
+	    reader.SkipLine();
       }
       else
       {
 	    cerr << "unknown command '" << cmd << "'.\n";
 	    break;
       }
-      if (!(file >> cmd))
+
+      if (reader.Failed())
         break;
-    }
   }
 
-  file.close();
+  if (reader.Failed()) {
+    cerr << "malformed number after command '" << cmd << "'.\n";
+    return false;
+  }
   return true;
 };
 
+// P3F file read through the memory mapped tokenizer. The vertices and faces of the meshes are parsed, and their
+// triangles built, in parallel on the pool
+bool Scene::load_p3f(const char *name, ThreadPool* pool)
+{
+  P3FReader	reader;
+
+  if (!reader.Open(name))
+    return false;
+  return parse_p3f(reader, name, pool);
+}
+
+bool Scene::load_p3f_stream(const char *name)
+{
+  P3FStreamReader	reader;
+
+  if (!reader.Open(name))
+    return false;
+  return parse_p3f(reader, name, NULL);
+}
+
 void Scene::create_random_scene() {
 	Camera* camera;
 	Material* material;
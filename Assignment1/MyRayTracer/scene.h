@@ -2,6 +2,8 @@
 #define SCENE_H
 
 #include <vector>
+#include <map>
+#include <string>
 #include <cmath>
 #include <IL/il.h>
 using namespace std;
@@ -11,6 +13,7 @@ using namespace std;
 #include "vector.h"
 #include "ray.h"
 #include "boundingBox.h"
+#include "threadPool.h"
 
 //Type of acceleration structure
 typedef enum { NONE, GRID_ACC, BVH_ACC }  accelerator;
@@ -52,14 +55,50 @@ private:
 	float m_RIndex;
 };
 
+//Shape of a light source
+typedef enum { POINT_LIGHT, RECT_LIGHT, DISK_LIGHT, SPHERE_LIGHT } LightType;
+
 class Light
 {
 public:
 
-	Light( Vector& pos, Color& col ): position(pos), color(col) {};
+	Light( Vector& pos, Color& col ): position(pos), color(col), type(POINT_LIGHT), radius(0.0f) {};
+
+	// Area lights centered at position. The color is spread over the surface: sampling it n times and adding color / n
+	// per sample point gives the same brightness as a point light
+	void SetRectangle(Vector& edge_u, Vector& edge_v);  //parallelogram spanned by the two edges
+	void SetDisk(Vector& normal, float radius);
+	void SetSphere(float radius);
+
+	LightType GetType() { return type; }
+	bool IsArea() { return type != POINT_LIGHT; }
+
+	// Point of the light for the point (u, v) of the unit square, seen from the point from: the whole rectangle or disk,
+	// the hemisphere of a sphere light that faces from. The position for a point light
+	Vector SamplePoint(float u, float v, Vector& from);
 	
 	Vector position;
 	Color color;
+
+private:
+	LightType type;
+	Vector edge_u, edge_v;  //rectangle edges; the disk plane axes, with length radius
+	float radius;
+};
+
+class Object;
+
+// --------------------------------------------------------------------- HitRecord
+// What an intersection test learns about a hit, kept so only the closest hit is shaded: the traversal fills t (and
+// object and point once the closest hit is known), the shading step asks the object for the normal there
+
+struct HitRecord {
+	float t;          //distance along the ray
+	Object* object;   //top level object of the scene
+	Vector point;
+	int face;         //face of a mesh or a box
+	float u, v;       //barycentric coordinates of the hit in the face of a mesh
+	float time;       //time of the ray, for the moving objects
 };
 
 class Object
@@ -68,11 +107,17 @@ public:
 
 	Material* GetMaterial() { return m_Material; }
 	void SetMaterial( Material *a_Mat ) { m_Material = a_Mat; }
-	virtual bool intercepts( Ray& r, float& dist ) = 0;
-	virtual Vector getNormal( Vector point ) = 0;
+
+	//Intersections only write to the hit record, so any number of threads can test the same object
+	virtual bool intercepts( const Ray& r, HitRecord& hit ) const = 0;
+	virtual Vector getNormal( const HitRecord& hit ) const = 0;
 	virtual AABB GetBoundingBox() { return AABB(); }
 	Vector getCentroid(void) { return GetBoundingBox().centroid(); }
 
+	//Motion blur: moving objects give their bounds at a time of the shutter interval; GetBoundingBox() covers all of it
+	virtual bool IsMoving() { return false; }
+	virtual AABB GetBoundingBoxAt(float time) { return GetBoundingBox(); }
+
 protected:
 	Material* m_Material;
 	
@@ -88,8 +133,8 @@ public:
 		 Plane		(Vector& PNc, float Dc);
 		 Plane		(Vector& P0, Vector& P1, Vector& P2);
 
-		 bool intercepts( Ray& r, float& dist );
-         Vector getNormal(Vector point);
+		 bool intercepts( const Ray& r, HitRecord& hit ) const;
+         Vector getNormal(const HitRecord& hit) const;
 };
 
 class Triangle : public Object
@@ -97,8 +142,8 @@ class Triangle : public Object
 	
 public:
 	Triangle	(Vector& P0, Vector& P1, Vector& P2);
-	bool intercepts( Ray& r, float& t);
-	Vector getNormal(Vector point);
+	bool intercepts( const Ray& r, HitRecord& hit ) const;
+	Vector getNormal(const HitRecord& hit) const;
 	AABB GetBoundingBox(void);
 	
 protected:
@@ -115,28 +160,48 @@ public:
 		center( a_center ), SqRadius( a_radius * a_radius ), 
 		radius( a_radius ) {};
 
-	bool intercepts( Ray& r, float& t);
-	Vector getNormal(Vector point);
+	bool intercepts( const Ray& r, HitRecord& hit ) const;
+	Vector getNormal(const HitRecord& hit) const;
 	AABB GetBoundingBox(void);
 
+	Vector GetCenter() { return center; }
+	float GetRadius() { return radius; }
+	void SetCenter(Vector& a_center) { center = a_center; }
+
 private:
 	Vector center;
 	float radius, SqRadius;
 };
 
+class MovingSphere : public Object  //Sphere moving linearly from center0 (shutter open, time 0) to center1 (time 1)
+{
+public:
+	MovingSphere(Vector& a_center0, Vector& a_center1, float a_radius);
+
+	bool intercepts(const Ray& r, HitRecord& hit) const;
+	Vector getNormal(const HitRecord& hit) const;  //at the time of the ray
+	AABB GetBoundingBox(void);
+	AABB GetBoundingBoxAt(float time);
+	bool IsMoving() { return true; }
+
+	Vector GetCenter(float time) const { return center0 + (center1 - center0) * time; }
+
+private:
+	Vector center0, center1;
+	float radius, SqRadius;
+};
+
 class aaBox : public Object   //Axis aligned box: another geometric object
 {
 public:
 	aaBox(Vector& minPoint, Vector& maxPoint);
 	AABB GetBoundingBox(void);
-	bool intercepts(Ray& r, float& t);
-	Vector getNormal(Vector point);
+	bool intercepts(const Ray& r, HitRecord& hit) const;
+	Vector getNormal(const HitRecord& hit) const;  //of the face hit
 
 private:
 	Vector min;
 	Vector max;
-
-	Vector Normal;
 };
 
 
@@ -162,6 +227,11 @@ public:
 
 	int getNumObjects( );
 	void addObject( Object* o );
+	//Shapes of the P3F file (s, box, p, import): added to the scene, or kept as the prototype named by the last
+	//"object" command, to be placed by instances only
+	void addShape( Object* o );
+	void definePrototype(const string& name) { pending_prototype = name; }
+	Object* getPrototype(const string& name);
 	Object* getObject( unsigned int index );
 	
 	int getNumLights( );
@@ -169,18 +239,24 @@ public:
 	Light* getLight( unsigned int index );
 	void setLights(vector<Light*> newLights);
 
-	bool load_p3f(const char *name);  //Load NFF file method
+	bool load_p3f(const char *name, ThreadPool* pool = NULL);  //Load NFF file method
+	bool load_p3f_stream(const char *name);  //same through an ifstream, the baseline of the loader benchmark
 	void create_random_scene();
 	
 private:
 	vector<Object *> objects;
 	vector<Light *> lights;
+	map<string, Object*> prototypes;
+	string pending_prototype;
 
 	Camera* camera;
 	Color bgColor;  //Background color
 	unsigned int samples_per_pixel;  // samples per pixel
 	accelerator accel_struc_type;
 
+	//Commands of a P3F file, from either tokenizer
+	template <class Reader> bool parse_p3f(Reader& reader, const char *name, ThreadPool* pool);
+
 	bool SkyBoxFlg = false;
 
 	struct {
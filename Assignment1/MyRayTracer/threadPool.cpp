@@ -0,0 +1,62 @@
+#include "threadPool.h"
+
+ThreadPool::ThreadPool(unsigned int n_threads) : job(NULL), job_tasks(0), job_id(0), busy(0), quit(false), next_task(0) {
+	if (n_threads == 0) n_threads = std::thread::hardware_concurrency();
+	if (n_threads == 0) n_threads = 1;
+
+	for (unsigned int i = 1; i < n_threads; i++)
+		workers.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	job_cv.notify_all();
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+void ThreadPool::Run(int n_tasks, const std::function<void(int)>& task) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &task;
+		job_tasks = n_tasks;
+		next_task = 0;
+		busy = workers.size();
+		job_id++;
+	}
+	job_cv.notify_all();
+
+	RunTasks();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done_cv.wait(lock, [this] { return busy == 0; });
+	job = NULL;
+}
+
+void ThreadPool::WorkerLoop() {
+	unsigned int last_job = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			job_cv.wait(lock, [&] { return quit || job_id != last_job; });
+			if (quit) return;
+			last_job = job_id;
+		}
+
+		RunTasks();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--busy == 0) done_cv.notify_one();
+	}
+}
+
+void ThreadPool::RunTasks() {
+	const std::function<void(int)>& task = *job;
+
+	for (int i = next_task++; i < job_tasks; i = next_task++)
+		task(i);
+}
@@ -0,0 +1,74 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <chrono>
+
+// --------------------------------------------------------------------- ThreadPool
+// Fixed set of worker threads that run one job at a time: the tasks 0..n_tasks-1 are handed out one by one through
+// an atomic counter, so tasks of uneven cost (image tiles) keep every thread busy. The thread calling Run() works too
+
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned int n_threads = 0);  //total threads, the caller included. 0: one per hardware thread
+	~ThreadPool();
+
+	//Runs task(i) for every i in [0, n_tasks) and returns when all of them are finished
+	void Run(int n_tasks, const std::function<void(int)>& task);
+
+	unsigned int GetNumThreads() { return workers.size() + 1; }
+
+private:
+	void WorkerLoop();
+	void RunTasks();
+
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable job_cv;   // a new job was posted or the pool is shutting down
+	std::condition_variable done_cv;  // the last worker left the current job
+	const std::function<void(int)>* job;
+	int job_tasks;
+	unsigned int job_id;              // bumped for every job, so a worker never runs the same job twice
+	int busy;                         // workers that have not finished the current job yet
+	bool quit;
+
+	std::atomic<int> next_task;
+};
+
+// --------------------------------------------------------------------- CancelToken
+// Tells the tasks of a job to stop: cancelled explicitly from any thread or once its time budget runs out. The tasks
+// check it when they start (tile granularity), so a cancelled job returns after the tasks already running
+
+class CancelToken
+{
+public:
+	CancelToken() : cancelled(false), has_deadline(false) {}
+
+	void Cancel() { cancelled = true; }
+
+	//Cancel by itself ms milliseconds from now. Set it before the job starts
+	void SetBudget(double ms) {
+		deadline = std::chrono::steady_clock::now() + std::chrono::microseconds((long long)(ms * 1000.0));
+		has_deadline = true;
+	}
+
+	bool IsCancelled() {
+		if (cancelled) return true;
+		if (has_deadline && std::chrono::steady_clock::now() >= deadline) cancelled = true;
+		return cancelled;
+	}
+
+private:
+	std::atomic<bool> cancelled;
+	bool has_deadline;
+	std::chrono::steady_clock::time_point deadline;
+};
+
+#endif
@@ -13,18 +13,18 @@ public:
 	Vector(float x, float y, float z);
 	Vector(const Vector& v);
 
-	float length();
+	float length() const;
 
-	float getAxisValue(int axis);
+	float getAxisValue(int axis) const;
 
 	Vector&	normalize();
 	Vector operator=(const Vector& v);
-	Vector operator+( const Vector& v );
-	Vector operator-( const Vector& v );
-	Vector operator*( float f );
-	float  operator*(const Vector& v);   //inner product
-	Vector operator/( float f );
-	Vector operator%( const Vector& v); //external product
+	Vector operator+( const Vector& v ) const;
+	Vector operator-( const Vector& v ) const;
+	Vector operator*( float f ) const;
+	float  operator*(const Vector& v) const;   //inner product
+	Vector operator/( float f ) const;
+	Vector operator%( const Vector& v) const; //external product
 	Vector&	operator-=	(const Vector& v);
 	Vector&	operator-=	(const float v);
 	Vector&	operator*=	(const float v);